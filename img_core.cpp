@@ -1,18 +1,30 @@
 
 #include "img_core.hpp"
 #include "util_color.hpp"
+#include "util_io.hpp"
 #include "util_term.hpp"
+#include "util_tile.hpp"
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/lexical_cast.hpp>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <set>
 #include <thread>
 
+#include <unistd.h>
+
 using namespace cv;
 using namespace util_color;
+using namespace util_io;
 using namespace util_term;
+using namespace util_tile;
 
 using std::cout;
 using std::endl;
@@ -50,10 +62,216 @@ CanvasState::CanvasState()
  */
 CanvasState::~CanvasState()
 {
+    release_cache();
     this->mat->release();
     delete this->mat;
 }
 
+/** Replace the image matrix of the state. (drops all cached data)
+ */
+void CanvasState::set_mat(Mat mat)
+{
+    *this->mat = mat;
+    this->dirty = Rect(0, 0, mat.cols, mat.rows);
+    this->tiles.clear();
+    release_cache();
+}
+
+/** Compute the per-channel mean and standard deviation of a rectangle of
+ *  the image in constant time, from integral images built on first use.
+ *  (the integrals take 16 bytes per channel per pixel until released)
+ */
+void CanvasState::roi_statistics(Rect rect, Scalar &mean, Scalar &stddev)
+{
+    if (integral_sum.empty())
+        integral(*mat, integral_sum, integral_sqsum, CV_64F, CV_64F);
+
+    rect &= Rect(0, 0, mat->cols, mat->rows);
+    int cn = mat->channels();
+    double n = rect.area();
+    mean = stddev = Scalar::all(0);
+    if (n == 0)
+        return;
+
+    int x0 = rect.x * cn, x1 = (rect.x + rect.width) * cn;
+    int y0 = rect.y, y1 = rect.y + rect.height;
+    const double *s0 = integral_sum.ptr<double>(y0);
+    const double *s1 = integral_sum.ptr<double>(y1);
+    const double *q0 = integral_sqsum.ptr<double>(y0);
+    const double *q1 = integral_sqsum.ptr<double>(y1);
+    for (int c = 0; c < cn; c++) {
+        double sum = s1[x1 + c] - s1[x0 + c] - s0[x1 + c] + s0[x0 + c];
+        double sqsum = q1[x1 + c] - q1[x0 + c] - q0[x1 + c] + q0[x0 + c];
+        mean.val[c] = sum / n;
+        stddev.val[c] = sqrt(max(0., sqsum / n - mean.val[c] * mean.val[c]));
+    }
+}
+
+/** Compute the per-channel histograms of a rectangle of the image from
+ *  block-wise integral histograms built on first use. (see IntegralHistogram)
+ */
+Histograms CanvasState::roi_histograms(Rect rect, ThreadPool *pool)
+{
+    if (!integral_hist)
+        integral_hist = new IntegralHistogram(*mat, 64, pool);
+    return integral_hist->query(rect);
+}
+
+/** Release all data cached for the current image matrix.
+ */
+void CanvasState::release_cache()
+{
+    integral_sum.release();
+    integral_sqsum.release();
+    delete integral_hist;
+    integral_hist = nullptr;
+    pyramid.clear();
+}
+
+/** Return a level of the image pyramid of the state, (0: the image itself)
+ *  building the missing levels.
+ */
+Mat CanvasState::pyramid_level(int level)
+{
+    while ((int)pyramid.size() < level) {
+        Mat down;
+        pyrDown(pyramid.empty() ? *mat : pyramid.back(), down);
+        pyramid.push_back(down);
+    }
+    return level ? pyramid[level - 1] : *mat;
+}
+
+/** Return the number of history tiles of an image of the given size.
+ */
+static int count_tiles(Size size)
+{
+    return ((size.width + HISTORY_TILE - 1) / HISTORY_TILE) *
+           ((size.height + HISTORY_TILE - 1) / HISTORY_TILE);
+}
+
+/** Return the rectangle of the i-th history tile (row-major) of an image of
+ *  the given size.
+ */
+static Rect tile_rect(Size size, int i)
+{
+    int grid_cols = (size.width + HISTORY_TILE - 1) / HISTORY_TILE;
+    int x = (i % grid_cols) * HISTORY_TILE;
+    int y = (i / grid_cols) * HISTORY_TILE;
+    return Rect(x, y, min(HISTORY_TILE, size.width - x),
+                min(HISTORY_TILE, size.height - y));
+}
+
+/** Return whether two matrices of the same size and type hold equal bytes.
+ */
+static bool equal_bytes(const Mat &a, const Mat &b)
+{
+    size_t row_bytes = a.cols * a.elemSize();
+    for (int y = 0; y < a.rows; y++)
+        if (memcmp(a.ptr(y), b.ptr(y), row_bytes))
+            return false;
+    return true;
+}
+
+/** Cut the image matrix into history tiles, unless already done.
+ *  Tiles outside the dirty region, or with unchanged content, are shared with
+ *  the previous state (if any, and of the same size and type).
+ */
+void CanvasState::freeze(CanvasState *prev)
+{
+    if (!tiles.empty() || mat->empty())
+        return;
+
+    tiled_size = mat->size();
+    tiled_type = mat->type();
+    bool can_share = prev && !prev->tiles.empty() &&
+                     prev->tiled_size == tiled_size &&
+                     prev->tiled_type == tiled_type;
+
+    tiles.resize(count_tiles(tiled_size));
+    for (int i = 0; i < tiles.size(); i++) {
+        Rect r = tile_rect(tiled_size, i);
+        Mat block = (*mat)(r);
+        if (can_share && ((r & dirty).area() == 0 ||
+                          equal_bytes(block, prev->tiles[i])))
+            tiles[i] = prev->tiles[i]; // shared (reference counted)
+        else
+            tiles[i] = block.clone();
+    }
+}
+
+/** Rebuild the contiguous image matrix from the history tiles.
+ */
+void CanvasState::thaw()
+{
+    if (mat->empty())
+        *mat = pixels();
+}
+
+/** Use views into the matrix (e.g. a mapped file) as the history tiles.
+ *  (no copy; the state keeps no contiguous matrix)
+ */
+void CanvasState::set_tiles(Mat full)
+{
+    release_cache();
+    mat->release();
+    tiled_size = full.size();
+    tiled_type = full.type();
+    tiles.resize(count_tiles(tiled_size));
+    for (int i = 0; i < tiles.size(); i++)
+        tiles[i] = full(tile_rect(tiled_size, i));
+}
+
+/** Return the image of the state: the matrix, or else a copy assembled from
+ *  the history tiles.
+ */
+Mat CanvasState::pixels()
+{
+    if (!mat->empty() || tiles.empty())
+        return *mat;
+
+    Mat full(tiled_size, tiled_type);
+    for (int i = 0; i < tiles.size(); i++) {
+        Mat block = full(tile_rect(tiled_size, i));
+        tiles[i].copyTo(block);
+    }
+    return full;
+}
+
+/** Return the size of the image of the state.
+ */
+Size CanvasState::image_size()
+{
+    return mat->empty() && !tiles.empty() ? tiled_size : mat->size();
+}
+
+/** Return the matrix type of the image of the state.
+ */
+int CanvasState::image_type()
+{
+    return mat->empty() && !tiles.empty() ? tiled_type : mat->type();
+}
+
+/** Release the contiguous image matrix (and all cached data) of a frozen
+ *  state; the tiles are kept.
+ */
+void CanvasState::release_mat()
+{
+    release_cache();
+    if (!tiles.empty())
+        mat->release();
+}
+
+/** Return the number of tiles shared with the other state.
+ */
+int CanvasState::count_shared_tiles(CanvasState *other)
+{
+    int n = 0;
+    if (other && other->tiles.size() == tiles.size())
+        for (int i = 0; i < tiles.size(); i++)
+            n += tiles[i].data == other->tiles[i].data;
+    return n;
+}
+
 /** Constructor of Canvas. (given matrix size and type)
  */
 Canvas::Canvas(string id, int rows, int cols, int cv_type)
@@ -65,6 +283,7 @@ Canvas::Canvas(string id, int rows, int cols, int cv_type)
     this->cv_type = cv_type;
     // A new canvas starts with an initial state.
     this->current = new CanvasState(rows, cols, cv_type);
+    assign_state_id(this->current);
     this->history.push_back(this->current);
 }
 
@@ -79,6 +298,7 @@ Canvas::Canvas(string id)
     this->cv_type = CV_8UC3;
     // A new canvas starts with an initial state.
     this->current = new CanvasState();
+    assign_state_id(this->current);
     this->history.push_back(this->current);
 }
 
@@ -89,6 +309,290 @@ Canvas::~Canvas()
     for (auto &state : history) {
         delete state;
     }
+    if (!spill_path.empty())
+        std::remove(spill_path.c_str());
+    delete tiled;
+}
+
+/** Append a new state holding the image matrix and make it current.
+ *  The states that could have been redone are discarded. Only the dirty
+ *  region is expected to differ from the current state; tiles outside of it
+ *  will be shared.
+ */
+void Canvas::commit(Mat mat, Rect dirty)
+{
+    auto it = std::find(history.begin(), history.end(), current);
+    for (auto next = std::next(it); next != history.end(); ) {
+        delete *next;
+        next = history.erase(next);
+    }
+
+    CanvasState *state = new CanvasState();
+    assign_state_id(state);
+    state->set_mat(mat);
+    state->dirty = dirty & Rect(0, 0, mat.cols, mat.rows);
+    if (mat.size() == current->mat->size())
+        state->roi = current->roi;
+    else
+        state->roi = Rect2d(0, 0, mat.cols, mat.rows);
+
+    history.push_back(state);
+    switch_to_state(state);
+}
+
+/** Make the previous state current. (false if there is none)
+ */
+bool Canvas::undo()
+{
+    auto it = std::find(history.begin(), history.end(), current);
+    if (it == history.begin())
+        return false;
+    switch_to_state(*std::prev(it));
+    return true;
+}
+
+/** Make the next state current. (false if there is none)
+ */
+bool Canvas::redo()
+{
+    auto it = std::find(history.begin(), history.end(), current);
+    if (std::next(it) == history.end())
+        return false;
+    switch_to_state(*std::next(it));
+    return true;
+}
+
+/** Return the memory taken by the history tiles of all states.
+ *  (shared tiles are counted once)
+ */
+size_t Canvas::history_bytes()
+{
+    std::set<const uchar *> seen;
+    size_t bytes = 0;
+    for (CanvasState *state : history)
+        for (Mat &tile : state->tiles)
+            if (seen.insert(tile.data).second)
+                bytes += tile.total() * tile.elemSize();
+    return bytes;
+}
+
+/** Evict the oldest states until the history fits in the budget (bytes).
+ *  The current state is never evicted.
+ */
+void Canvas::trim_history(size_t budget)
+{
+    while (history.front() != current && history_bytes() > budget) {
+        delete history.front();
+        history.pop_front();
+    }
+}
+
+/** Hand out the matrix of the last state left, for a procedure to write its
+ *  result into. (empty if there is none, if it is still referenced, or if it
+ *  is mapped from a spill file)
+ */
+Mat Canvas::take_spare_buffer()
+{
+    Mat buf = spare;
+    spare.release();
+    if ((buf.u && buf.u->refcount > 1) || is_mapped(buf))
+        return Mat();
+    return buf;
+}
+
+/** Return the memory taken by the canvas: the current matrix (unless
+ *  spilled), the spare buffer and the history tiles.
+ */
+size_t Canvas::resident_bytes()
+{
+    Mat *mat = current->mat;
+    return mat->total() * mat->elemSize() + spare.total() * spare.elemSize() +
+           history_bytes() + (lazy ? lazy->memo_bytes() : 0);
+}
+
+/** Write the current matrix to spill_path and release it, along with the
+ *  spare buffer and cached data. (returns the bytes released)
+ *  A matrix still mapped unchanged from the file is not written again:
+ *  (mapped_data is cleared whenever the current state changes, and mapped
+ *  buffers are never recycled, so a mapped current matrix is unchanged)
+ *  Otherwise the file is written aside and renamed over the old one, since
+ *  matrices mapped from it (e.g. snapshots of jobs) may still be in use.
+ */
+size_t Canvas::spill()
+{
+    Mat *mat = current->mat;
+    if (is_spilled || mat->empty())
+        return 0;
+    bool is_clean = mat->data == mapped_data && is_mapped(*mat);
+    if (!is_clean) {
+        string temp_path = spill_path + ".tmp";
+        if (!write_raw(temp_path, *mat) ||
+            std::rename(temp_path.c_str(), spill_path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return 0;
+        }
+    }
+
+    size_t bytes = mat->total() * mat->elemSize() +
+                   spare.total() * spare.elemSize();
+    current->release_cache();
+    mat->release();
+    spare.release();
+    mapped_data = nullptr;
+    is_spilled = true;
+    return bytes;
+}
+
+/** Map the spilled current matrix back in. (pages are read on access)
+ */
+bool Canvas::reload()
+{
+    if (!is_spilled)
+        return true;
+    Mat mat = map_file(spill_path, rows, cols, cv_type);
+    if (mat.empty())
+        return false;
+    *current->mat = mat;
+    mapped_data = mat.data;
+    is_spilled = false;
+    return true;
+}
+
+/** Replace the history of the canvas. (e.g. with states of a workspace)
+ */
+void Canvas::restore_history(list<CanvasState *> states, CanvasState *current,
+                             int state_counter)
+{
+    for (auto &state : history)
+        delete state;
+    spare.release();
+    mapped_data = nullptr;
+    history = states;
+    this->current = current;
+    this->state_counter = state_counter;
+    rows = current->mat->rows;
+    cols = current->mat->cols;
+    cv_type = current->mat->type();
+}
+
+/** Return the number of state ids assigned so far.
+ */
+int Canvas::get_state_counter()
+{
+    return state_counter;
+}
+
+/** Assign the next state id of the canvas.
+ */
+void Canvas::assign_state_id(CanvasState *state)
+{
+    state->id = "S" + to_string(++state_counter);
+}
+
+/** Switch the current state, storing the one left as tiles.
+ */
+void Canvas::switch_to_state(CanvasState *state)
+{
+    auto it = std::find(history.begin(), history.end(), current);
+    current->freeze(it == history.begin() ? nullptr : *std::prev(it));
+    if (!current->tiles.empty() && !is_mapped(*current->mat))
+        spare = *current->mat;
+    current->release_mat();
+    mapped_data = nullptr; // (the spill file holds the state left)
+
+    current = state;
+    current->thaw();
+    rows = current->mat->rows;
+    cols = current->mat->cols;
+    cv_type = current->mat->type();
+}
+
+/** Constructor of LazyImage. (given the source matrix or lazy image, the
+ *  bound procedure, and the ROI of the source)
+ */
+LazyImage::LazyImage(Mat source, std::shared_ptr<LazyImage> input,
+                     std::shared_ptr<PointwiseStage> stage, Rect roi)
+{
+    this->source = source;
+    this->input = input;
+    this->stage = stage;
+    this->roi = roi;
+    size = input ? input->size : source.size();
+    type = stage->result_type(input ? input->type : source.type());
+}
+
+/** Return the pixels of a region of the image, evaluating them unless a
+ *  memoized region contains it. (the matrix must not be modified)
+ */
+Mat LazyImage::evaluate(Rect rect, ThreadPool *pool)
+{
+    rect &= Rect(0, 0, size.width, size.height);
+    for (auto it = memo.begin(); it != memo.end(); ++it) {
+        Rect known = it->first;
+        if ((known & rect) == rect) {
+            memo.splice(memo.begin(), memo, it);
+            return it->second(Rect(rect.x - known.x, rect.y - known.y,
+                                   rect.width, rect.height));
+        }
+    }
+
+    reduce(pool);
+    Mat in = evaluate_input(rect, pool);
+    Mat out(rect.size(), type);
+    parallel_for_bands(pool, rect.height, [&](int band, int begin, int end) {
+        Mat dst_band = out.rowRange(begin, end);
+        stage->apply(in.rowRange(begin, end), dst_band);
+    });
+
+    memo.push_front({rect, out});
+    if (memo.size() > LAZY_MEMO_ENTRIES)
+        memo.pop_back();
+    return out;
+}
+
+/** Return the memory taken by the memoized regions.
+ */
+size_t LazyImage::memo_bytes()
+{
+    size_t bytes = 0;
+    for (auto &entry : memo)
+        bytes += entry.second.total() * entry.second.elemSize();
+    return bytes;
+}
+
+Mat LazyImage::evaluate_input(Rect rect, ThreadPool *pool)
+{
+    return input ? input->evaluate(rect, pool) : source(rect);
+}
+
+/** Make the reductions the procedure needs, over its whole input or the ROI
+ *  of the source. (once; the stage reads the regions in place, as views of
+ *  the source or of memoized regions, which it must not write)
+ */
+void LazyImage::reduce(ThreadPool *pool)
+{
+    if (is_reduced || stage->reductions == REDUCE_NONE)
+        return;
+
+    Rect full(0, 0, size.width, size.height);
+    Rect area = stage->reduces_roi ? roi & full : full;
+    if (area.area() == 0)
+        area = full;
+    Mat in = evaluate_input(area, pool);
+    stage->begin_reduction(band_count(area.height));
+    parallel_for_bands(pool, area.height, [&](int band, int begin, int end) {
+        stage->reduce(band, in.rowRange(begin, end));
+    });
+    stage->end_reduction();
+    is_reduced = true;
+}
+
+/** Return whether the job has finished. (does not block)
+ */
+bool Job::is_finished()
+{
+    return future.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
 }
 
 /** Singleton instantiator of ImgineContext.
@@ -109,18 +613,47 @@ ImgineContext::~ImgineContext()
         thread.join();
     }
     debug("Done.\n");
+    wait_jobs(-1); // (pending exports are flushed)
+    if (!config.workspace_file.empty()) {
+        if (save_workspace(config.workspace_file))
+            debug("Workspace saved to %s\n", config.workspace_file.c_str());
+        else
+            err("Cannot save workspace to %s\n",
+                config.workspace_file.c_str());
+    }
     for (auto &canvas : canvases) {
         delete canvas;
     }
-    // TODO: save workspace
+}
+
+/** Set the number of threads procedures run on. (0: one per hardware thread)
+ *  The calling thread takes part, so the pool gets one worker less.
+ */
+void ImgineContext::set_threads(int threads)
+{
+    if (threads <= 0)
+        threads = hardware_threads();
+    config.threads = threads;
+    pool.resize(threads - 1);
+}
+
+/** Install the pooled matrix allocator, keeping at most the given bytes of
+ *  freed buffers for reuse. (0: keep the standard allocator)
+ */
+void ImgineContext::set_allocator(size_t max_cached_bytes, bool is_huge_pages)
+{
+    if (allocator || !max_cached_bytes)
+        return;
+    allocator = install_pool_allocator(max_cached_bytes, is_huge_pages);
+    debug("Pooled allocator installed (%zu MiB%s).\n", max_cached_bytes >> 20,
+          is_huge_pages ? ", huge pages" : "");
 }
 
 /** Create a new canvas. (given matrix size and type)
  */
 void ImgineContext::new_canvas(int rows, int cols, int cv_type)
 {
-    ++canvas_counter;
-    string id = "C" + to_string(canvas_counter);
+    string id = next_canvas_id();
     this->active_canvas = new Canvas(id, rows, cols, cv_type);
     this->canvases.push_back(this->active_canvas);
 }
@@ -129,27 +662,369 @@ void ImgineContext::new_canvas(int rows, int cols, int cv_type)
  */
 void ImgineContext::new_canvas()
 {
-    ++canvas_counter;
-    string id = "C" + to_string(canvas_counter);
+    string id = next_canvas_id();
     this->active_canvas = new Canvas(id);
     this->canvases.push_back(this->active_canvas);
 }
 
+/** Assign the next canvas id, skipping ids taken as names. (e.g. by canvases
+ *  loaded from a workspace)
+ */
+string ImgineContext::next_canvas_id()
+{
+    string id;
+    do {
+        id = "C" + to_string(++canvas_counter);
+    } while (std::any_of(canvases.begin(), canvases.end(),
+                         [&id](Canvas *canvas) { return canvas->name == id; }));
+    return id;
+}
+
 /** Return a pointer to the canvas with the specified name.
+ *  (the canvas is reloaded if it was spilled)
  */
 Canvas *ImgineContext::get_canvas_by_name(string canvas_name)
 {
-    if (canvas_name == "@")
+    if (canvas_name == "@") {
+        touch(active_canvas);
         return active_canvas;
+    }
 
     for (auto &canvas : canvases) {
         if (canvas->name == canvas_name) {
+            touch(canvas);
             return canvas;
         }
     }
     return nullptr;
 }
 
+/** Return a file name in the scratch directory, unique to this process.
+ */
+string ImgineContext::scratch_file_name(string name, string extension)
+{
+    return config.scratch_dir + "/imgine-" + to_string(getpid()) + "-" +
+           name + extension;
+}
+
+/** Run a function as a background job. It must only use data it owns (e.g.
+ *  snapshots of matrices, which share buffers); an exception thrown fails
+ *  the job.
+ */
+Job *ImgineContext::start_job(string description, function<void()> fn)
+{
+    Job *job = new Job();
+    job->id = ++job_counter;
+    job->description = description;
+    job->started = getTickCount();
+    job->future = job_pool.submit([job, fn]() {
+        Progress::Scope scope(&job->progress);
+        try {
+            fn();
+            job->is_ok = true;
+        } catch (exception &e) {
+            job->error = e.what();
+        }
+    });
+    jobs.push_back(job);
+    return job;
+}
+
+/** Run the completions of the finished jobs that have not run yet. (returns
+ *  whether any did)
+ */
+bool ImgineContext::finish_jobs()
+{
+    bool is_any = false;
+    for (Job *job : jobs) {
+        if (job->on_finished && job->is_finished()) {
+            function<void()> fn = job->on_finished;
+            job->on_finished = nullptr;
+            fn();
+            is_any = true;
+        }
+    }
+    return is_any;
+}
+
+/** Report and remove the finished jobs. (after running their completions)
+ */
+void ImgineContext::reap_jobs()
+{
+    finish_jobs();
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        Job *job = *it;
+        if (!job->is_finished()) {
+            ++it;
+            continue;
+        }
+        if (job->is_ok)
+            cout << "  Job " << job->id << " done:\t" << job->description
+                 << endl;
+        else if (job->progress.is_cancelled)
+            cout << "  Job " << job->id << " cancelled:\t" << job->description
+                 << endl;
+        else
+            err("Job %d failed: %s (%s)\n", job->id,
+                job->description.c_str(), job->error.c_str());
+        delete job;
+        it = jobs.erase(it);
+    }
+}
+
+/** Wait for a background job to finish (-1: all of them), then report the
+ *  finished ones.
+ */
+void ImgineContext::wait_jobs(int id)
+{
+    for (Job *job : jobs)
+        if (id < 0 || job->id == id)
+            job->future.wait();
+    reap_jobs();
+}
+
+/** Mark the canvas as just used, reloading it if it was spilled.
+ */
+void ImgineContext::touch(Canvas *canvas)
+{
+    if (!canvas)
+        return;
+    canvas->last_used = ++use_counter;
+    if (canvas->is_spilled && !canvas->reload())
+        err("Cannot reload canvas %s from %s\n", canvas->name.c_str(),
+            canvas->spill_path.c_str());
+}
+
+/** Spill the least recently used inactive canvases to the scratch directory
+ *  until all canvases fit in the memory budget.
+ */
+void ImgineContext::enforce_memory_budget()
+{
+    if (!config.memory_budget)
+        return;
+
+    size_t total = 0;
+    for (Canvas *canvas : canvases)
+        total += canvas->resident_bytes();
+
+    while (total > config.memory_budget) {
+        Canvas *lru = nullptr;
+        for (Canvas *canvas : canvases)
+            if (canvas != active_canvas && !canvas->is_spilled &&
+                !canvas->current->mat->empty() &&
+                (!lru || canvas->last_used < lru->last_used))
+                lru = canvas;
+        if (!lru)
+            break;
+
+        if (lru->spill_path.empty())
+            lru->spill_path = scratch_file_name(lru->id, ".raw");
+        size_t bytes = lru->spill();
+        if (!bytes) {
+            err("Cannot spill canvas %s to %s\n", lru->name.c_str(),
+                lru->spill_path.c_str());
+            break;
+        }
+        debug("Spilled canvas %s (%zu KiB).\n", lru->name.c_str(),
+              bytes >> 10);
+        total -= min(total, bytes);
+    }
+}
+
+/** Workspace files start with the magic and the size of a text metadata
+ *  block, followed by the pixels of every state, uncompressed, each at a
+ *  page-aligned offset (relative to the first page after the metadata) so
+ *  that they can be mapped as they are.
+ */
+static const char WORKSPACE_MAGIC[8] = {'I', 'M', 'G', 'W', 'S', '0', '0', '1'};
+static const size_t WORKSPACE_ALIGN = 4096;
+
+static size_t align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+/** Save all canvases, with their history, into a workspace file.
+ *  The file is written aside and renamed over the old one, since canvases
+ *  loaded from it may still be mapped.
+ */
+bool ImgineContext::save_workspace(string file_name)
+{
+    // metadata, and where each state goes
+    stringstream meta;
+    meta.precision(17); // ROIs round-trip exactly
+    vector< std::pair<CanvasState *, size_t> > blobs;
+    size_t data_size = 0;
+    int active_index = -1, index = 0;
+    for (Canvas *canvas : canvases) {
+        if (canvas->tiled) {
+            warn("Tiled canvas %s not saved (export it to .imgt instead)\n",
+                 canvas->name.c_str());
+            continue;
+        }
+        touch(canvas); // reload if spilled (mapped, not read)
+        materialize(canvas);
+        if (canvas == active_canvas)
+            active_index = index;
+        index++;
+
+        int current_index = std::distance(canvas->history.begin(),
+            std::find(canvas->history.begin(), canvas->history.end(),
+                      canvas->current));
+        meta << "canvas " << canvas->history.size() << " " << current_index
+             << " " << canvas->get_state_counter() << " " << canvas->name
+             << "\n";
+        for (CanvasState *state : canvas->history) {
+            Size size = state->image_size();
+            int type = state->image_type();
+            Rect2d &roi = state->roi;
+            Rect &dirty = state->dirty;
+            meta << "state " << state->id << " " << size.height << " "
+                 << size.width << " " << type << " " << data_size << " "
+                 << roi.x << " " << roi.y << " " << roi.width << " "
+                 << roi.height << " " << dirty.x << " " << dirty.y << " "
+                 << dirty.width << " " << dirty.height << "\n";
+            blobs.push_back({state, data_size});
+            data_size = align_up(data_size + (size_t)size.area() *
+                                 CV_ELEM_SIZE(type), WORKSPACE_ALIGN);
+        }
+    }
+    meta << "active " << active_index << "\n";
+
+    string meta_str = meta.str();
+    uint64_t meta_size = meta_str.size();
+    size_t data_start = align_up(sizeof(WORKSPACE_MAGIC) + sizeof(meta_size) +
+                                 meta_size, WORKSPACE_ALIGN);
+
+    string temp_name = file_name + ".tmp";
+    FILE *f = fopen(temp_name.c_str(), "wb");
+    if (!f)
+        return false;
+    bool is_ok = fwrite(WORKSPACE_MAGIC, sizeof(WORKSPACE_MAGIC), 1, f) == 1 &&
+                 fwrite(&meta_size, sizeof(meta_size), 1, f) == 1 &&
+                 fwrite(meta_str.data(), 1, meta_size, f) == meta_size;
+    for (auto &blob : blobs) {
+        if (!is_ok)
+            break;
+        is_ok = fseeko(f, data_start + blob.second, SEEK_SET) == 0 &&
+                write_rows(f, blob.first->pixels());
+    }
+    is_ok = fclose(f) == 0 && is_ok;
+
+    if (is_ok && std::rename(temp_name.c_str(), file_name.c_str()) == 0)
+        return true;
+    std::remove(temp_name.c_str());
+    return false;
+}
+
+/** Load the canvases of a workspace file, in addition to the current ones.
+ *  Every state is mapped straight from the file (no decode, no copy); pages
+ *  are read on first access.
+ */
+bool ImgineContext::load_workspace(string file_name)
+{
+    FILE *f = fopen(file_name.c_str(), "rb");
+    if (!f)
+        return false;
+    char magic[sizeof(WORKSPACE_MAGIC)];
+    uint64_t meta_size = 0;
+    string meta_str;
+    bool is_ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+                 !memcmp(magic, WORKSPACE_MAGIC, sizeof(magic)) &&
+                 fread(&meta_size, sizeof(meta_size), 1, f) == 1;
+    if (is_ok) {
+        meta_str.resize(meta_size);
+        is_ok = fread(&meta_str[0], 1, meta_size, f) == meta_size;
+    }
+    fclose(f);
+    if (!is_ok)
+        return false;
+    size_t data_start = align_up(sizeof(WORKSPACE_MAGIC) + sizeof(meta_size) +
+                                 meta_size, WORKSPACE_ALIGN);
+
+    stringstream meta(meta_str);
+    string record;
+    vector<Canvas *> loaded;
+    int active_index = -1;
+    while (is_ok && meta >> record) {
+        if (record == "active") {
+            meta >> active_index;
+            continue;
+        } else if (record != "canvas") {
+            is_ok = false;
+            break;
+        }
+
+        int state_count = 0, current_index = 0, state_counter = 0;
+        string name;
+        meta >> state_count >> current_index >> state_counter >> std::ws;
+        std::getline(meta, name);
+
+        list<CanvasState *> states;
+        CanvasState *current = nullptr;
+        for (int i = 0; i < state_count && is_ok; i++) {
+            CanvasState *state = new CanvasState();
+            int rows = 0, cols = 0, type = 0;
+            size_t offset = 0;
+            Rect2d &roi = state->roi;
+            Rect dirty;
+            meta >> record >> state->id >> rows >> cols >> type >> offset
+                 >> roi.x >> roi.y >> roi.width >> roi.height
+                 >> dirty.x >> dirty.y >> dirty.width >> dirty.height;
+
+            bool is_empty = rows == 0 || cols == 0; // e.g. a new canvas
+            Mat mapped;
+            if (record == "state" && IMG_CV_TYPES.count(type) && !is_empty)
+                mapped = map_file(file_name, rows, cols, type,
+                                  data_start + offset);
+            if (record != "state" || (mapped.empty() && !is_empty)) {
+                delete state;
+                is_ok = false;
+                break;
+            }
+            if (i == current_index) {
+                state->set_mat(mapped);
+                current = state;
+            } else if (!is_empty) {
+                state->set_tiles(mapped);
+            }
+            state->dirty = dirty;
+            states.push_back(state);
+        }
+        if (!is_ok || !current) {
+            for (auto &state : states)
+                delete state;
+            is_ok = false;
+            break;
+        }
+
+        Canvas *canvas = new Canvas(next_canvas_id());
+        if (name == "@" ||
+            std::any_of(canvases.begin(), canvases.end(),
+                        [&name](Canvas *c) { return c->name == name; })) {
+            warn("Canvas %s renamed to %s (name taken).\n", name.c_str(),
+                 canvas->id.c_str());
+        } else {
+            canvas->name = name;
+        }
+        canvas->restore_history(states, current, state_counter);
+        canvases.push_back(canvas);
+        loaded.push_back(canvas);
+    }
+
+    // a workspace is loaded whole or not at all
+    if (!is_ok) {
+        for (Canvas *canvas : loaded) {
+            canvases.remove(canvas);
+            delete canvas;
+        }
+        return false;
+    }
+    if (0 <= active_index && active_index < loaded.size())
+        active_canvas = loaded[active_index];
+    return true;
+}
+
 /** Colored printf for debugging-only log message.
  */
 void ImgineContext::debug(const char *fmt, ...)
@@ -211,76 +1086,123 @@ void ImgineContext::wtf(const char *fmt, ...)
 void ImgineContext::execute(vector<string> params)
 {
     string cmd = params.at(0);
+    touch(active_canvas);
+    reap_jobs();
 
-    if (cmd == ":status") {
-        execute_status(params);
+    // (commands report what they throw: tiles that cannot be read or written
+    // back, failed OpenCV assertions, unknown parameters)
+    try {
+        if (cmd == ":status") {
+            execute_status(params);
 
-    } else if (cmd == ":list" || cmd == ":l") {
-        execute_list(params);
+        } else if (cmd == ":list" || cmd == ":l") {
+            execute_list(params);
 
-    } else if (cmd == ":switch_to" || cmd == ":to") {
-        execute_switch_to(params);
+        } else if (cmd == ":switch_to" || cmd == ":to") {
+            execute_switch_to(params);
 
-    } else if (cmd == ":new" || cmd == ":n") {
-        execute_new(params);
+        } else if (cmd == ":new" || cmd == ":n") {
+            execute_new(params);
 
-    } else if (cmd == ":delete" || cmd == ":del") {
-        execute_delete(params);
+        } else if (cmd == ":delete" || cmd == ":del") {
+            execute_delete(params);
 
-    } else if (cmd == ":rename" || cmd == ":ren") {
-        execute_rename(params);
+        } else if (cmd == ":rename" || cmd == ":ren") {
+            execute_rename(params);
 
-    } else if (cmd == ":import" ||
-               cmd == ":read" || cmd == ":r") {
-        execute_import(params);
+        } else if (cmd == ":import" ||
+                   cmd == ":read" || cmd == ":r") {
+            execute_import(params);
 
-    } else if (cmd == ":export" ||
-               cmd == ":write" || cmd == ":w") {
-        execute_export(params);
+        } else if (cmd == ":import_raw") {
+            execute_import_raw(params);
 
-    } else if (cmd == ":properties" || cmd == ":prop" || cmd == ":p") {
-        execute_properties(params);
+        } else if (cmd == ":export" ||
+                   cmd == ":write" || cmd == ":w") {
+            execute_export(params);
 
-    } else if (cmd == ":roi") {
-        execute_roi(params);
+        } else if (cmd == ":properties" || cmd == ":prop" || cmd == ":p") {
+            execute_properties(params);
 
-    } else if (cmd == ":dump") {
-        execute_dump(params);
+        } else if (cmd == ":roi") {
+            execute_roi(params);
 
-    } else if (cmd == ":dump_roi") {
-        execute_dump_roi(params);
+        } else if (cmd == ":dump") {
+            execute_dump(params);
 
-    } else if (cmd == ":statistics" || cmd == ":stat" || cmd == ":st") {
-        execute_statistics(params);
+        } else if (cmd == ":dump_roi") {
+            execute_dump_roi(params);
 
-    } else if (cmd == ":show" || cmd == ":sh") {
-        execute_show(params);
+        } else if (cmd == ":statistics" || cmd == ":stat" || cmd == ":st") {
+            execute_statistics(params);
 
-    } else if (cmd == ":histogram" || cmd == ":hist" || cmd == ":hi") {
-        execute_histogram(params);
+        } else if (cmd == ":show" || cmd == ":sh") {
+            execute_show(params);
 
-    } else if (cmd == ":inspect" || cmd == ":i") {
-        execute_inspect(params, false);
+        } else if (cmd == ":histogram" || cmd == ":hist" || cmd == ":hi") {
+            execute_histogram(params);
 
-    } else if (cmd == ":inspect_histogram" || cmd == ":inspect_hist" ||
-               cmd == ":I") {
-        execute_inspect(params, true);
+        } else if (cmd == ":inspect" || cmd == ":i") {
+            execute_inspect(params, false);
 
-    } else if (cmd == ":procedure" || cmd == ":proc" || cmd == ":P") {
-        execute_procedure(params);
+        } else if (cmd == ":inspect_histogram" || cmd == ":inspect_hist" ||
+                   cmd == ":I") {
+            execute_inspect(params, true);
 
-    } else if (cmd == ":Pi") { // shortcut to ":proc then :inspect"
-        execute_procedure(params);
-        execute_inspect({}, false);
+        } else if (cmd == ":procedure" || cmd == ":proc" || cmd == ":P") {
+            execute_procedure(params, false);
 
-    } else if (cmd == ":PI") { // shortcut to ":proc then :inspect_hist"
-        execute_procedure(params);
-        execute_inspect({}, true);
+        } else if (cmd == ":Pi") { // shortcut to ":proc then :inspect"
+            execute_procedure(params, true);
+            execute_inspect({}, false);
 
-    } else {
-        // TODO: more commands
-        err("Unknown command.\n");
+        } else if (cmd == ":PI") { // shortcut to ":proc then :inspect_hist"
+            execute_procedure(params, true);
+            execute_inspect({}, true);
+
+        } else if (cmd == ":pipeline" || cmd == ":pipe") {
+            execute_pipeline(params);
+
+        } else if (cmd == ":benchmark") {
+            execute_benchmark(params);
+
+        } else if (cmd == ":undo" || cmd == ":u") {
+            execute_undo(params, false);
+
+        } else if (cmd == ":redo" || cmd == ":U") {
+            execute_undo(params, true);
+
+        } else if (cmd == ":history") {
+            execute_history(params);
+
+        } else if (cmd == ":fill") {
+            execute_fill(params);
+
+        } else if (cmd == ":save_workspace") {
+            execute_save_workspace(params);
+
+        } else if (cmd == ":load_workspace") {
+            execute_load_workspace(params);
+
+        } else if (cmd == ":jobs") {
+            execute_jobs(params);
+
+        } else if (cmd == ":wait") {
+            execute_wait(params);
+
+        } else if (cmd == ":cancel") {
+            execute_cancel(params);
+
+        } else {
+            // TODO: more commands
+            err("Unknown command.\n");
+        }
+    } catch (exception &e) { // (incl. cv::Exception, std::out_of_range)
+        err("%s\n", e.what());
     }
+
+    touch(active_canvas); // (may have switched)
+    enforce_memory_budget();
 }
 
 /** Return a string list presenting the image properties of the canvas.
@@ -307,6 +1229,9 @@ vector<string> ImgineContext::show_properties(Canvas *canvas)
     ret.push_back("  Color depth:\t" + to_string(bitdepth) + " bpc");
     ret.push_back("  Memory size:\t" +
                   (mib ? to_string(mib) + " MiB" : to_string(kib) + " KiB"));
+    if (canvas->preview_scale > 1)
+        ret.push_back("  Preview:\t1/" + to_string(canvas->preview_scale) +
+                      " scale of " + canvas->source_file);
 
     return ret;
 }
@@ -314,16 +1239,57 @@ vector<string> ImgineContext::show_properties(Canvas *canvas)
 /** Return a string list presenting some basic statistics of the matrix.
  */
 vector<string> ImgineContext::show_statistics(Mat *mat)
+{
+    Scalar mat_mean, mat_stddev;
+    if (mat->depth() == CV_8U)
+        histogram_statistics(compute_histograms(*mat, &pool),
+                             mat_mean, mat_stddev);
+    else
+        meanStdDev(*mat, mat_mean, mat_stddev);
+    return format_statistics(mat_mean, mat_stddev, mat->channels());
+}
+
+/** Return a string list presenting some basic statistics of the selected
+ *  ROI of the state. (constant time, see CanvasState::roi_statistics)
+ */
+vector<string> ImgineContext::show_statistics(CanvasState *state)
+{
+    Scalar mat_mean, mat_stddev;
+    state->roi_statistics(state->roi, mat_mean, mat_stddev);
+    return format_statistics(mat_mean, mat_stddev, state->mat->channels());
+}
+
+/** Return a string list presenting some basic statistics of the selected
+ *  ROI of the canvas. (tiled canvases are read tile by tile)
+ */
+vector<string> ImgineContext::show_statistics(Canvas *canvas)
+{
+    if (!canvas->tiled) {
+        Mat roi = roi_pixels(canvas);
+        vector<string> ret = show_statistics(&roi);
+        if (canvas->current->is_approximate)
+            ret.push_back("  (approx.: full resolution still being computed)");
+        return ret;
+    }
+
+    Scalar mat_mean, mat_stddev;
+    histogram_statistics(canvas_histograms(canvas), mat_mean, mat_stddev);
+    return format_statistics(mat_mean, mat_stddev, CV_MAT_CN(canvas->cv_type));
+}
+
+/** Return a string list presenting the given statistics.
+ */
+vector<string> ImgineContext::format_statistics(Scalar mat_mean,
+                                                Scalar mat_stddev,
+                                                int channels)
 {
     vector<string> ret;
     stringstream mat_mean_buf, mat_stddev_buf;
-    Scalar mat_mean, mat_stddev;
-    meanStdDev(*mat, mat_mean, mat_stddev);
     mat_mean_buf << mat_mean;
     mat_stddev_buf << mat_stddev;
 
     unsigned char r, g, b;
-    if (mat->channels() >= 3) {
+    if (channels >= 3) {
         b = mat_mean.val[0];
         g = mat_mean.val[1];
         r = mat_mean.val[2];
@@ -391,59 +1357,93 @@ vector<string> ImgineContext::show_pixel(Mat *mat, int x, int y)
  */
 Mat ImgineContext::draw_histogram(Mat *mat)
 {
-    Mat src_mat = mat->clone();
+    return render_histogram(compute_histograms(*mat, &pool));
+}
+
+/** Return the pixels of the selected ROI of a canvas that is not tiled. (only
+ *  the ROI of a lazy canvas is evaluated)
+ */
+Mat ImgineContext::roi_pixels(Canvas *canvas)
+{
+    if (canvas->lazy)
+        return canvas->lazy->evaluate(Rect(canvas->current->roi), &pool);
+    return Mat(*(canvas->current->mat), canvas->current->roi);
+}
+
+/** Return a histogram image of the selected ROI of the canvas.
+ */
+Mat ImgineContext::draw_histogram(Canvas *canvas)
+{
+    return render_histogram(canvas_histograms(canvas));
+}
+
+/** Return per-channel histograms of the selected ROI of the canvas.
+ *  A tiled canvas is reduced per row of tiles, and the partial histograms
+ *  merged in order.
+ */
+Histograms ImgineContext::canvas_histograms(Canvas *canvas)
+{
+    if (!canvas->tiled)
+        return compute_histograms(roi_pixels(canvas), &pool);
+
+    TiledImage *image = canvas->tiled;
+    int cn = CV_MAT_CN(image->type);
+    vector<Histograms> slot_hists(image->grid_rows,
+                                  Histograms(cn, vector<unsigned>(256, 0)));
+    reduce_tiles(image, Rect(canvas->current->roi), &pool,
+                 [&](int slot, const Mat &region) {
+        add_histograms(slot_hists[slot], region);
+    });
+
+    Histograms hists(cn, vector<unsigned>(256, 0));
+    for (const auto &slot : slot_hists)
+        for (int c = 0; c < cn; c++)
+            for (int i = 0; i < 256; i++)
+                hists[c][i] += slot[c][i];
+    return hists;
+}
+
+/** Return a histogram image of the selected ROI of the state.
+ *  (see CanvasState::roi_histograms)
+ */
+Mat ImgineContext::draw_histogram(CanvasState *state)
+{
+    return render_histogram(state->roi_histograms(state->roi, &pool));
+}
 
+/** Return a histogram image of per-channel histograms.
+ *  (one white curve for grayscale, blue, green and red curves otherwise)
+ */
+Mat ImgineContext::render_histogram(const Histograms &hists)
+{
     // histogram display colors
-    Scalar b, g, r;
-    if (src_mat.channels() == 1) {
-        // handle grayscale images
-        cvtColor(src_mat, src_mat, COLOR_GRAY2BGR);
-        b = g = r = Scalar(255, 255, 255);
+    vector<Scalar> colors;
+    if (hists.size() < 3) {
+        // handle grayscale images (and their alpha channel)
+        colors = {Scalar(255, 255, 255)};
     } else {
-        b = Scalar(255, 0, 0);
-        g = Scalar(0, 255, 0);
-        r = Scalar(0, 0, 255);
+        colors = {Scalar(255, 0, 0), Scalar(0, 255, 0), Scalar(0, 0, 255)};
     }
 
-    // split images into single-channel matrices
-    vector<Mat> src_comp;
-    split(src_mat, src_comp);
-
-    // calculate the histogram per channel
-    Mat b_hist, g_hist, r_hist;
     int hist_size = 256;
-    float range[] = {0, 256};
-    const float *hist_range = {range};
-    bool uniform = true, accumulate = false;
-    calcHist(&src_comp[0], 1, 0, Mat(),
-             b_hist, 1, &hist_size, &hist_range, uniform, accumulate);
-    calcHist(&src_comp[1], 1, 0, Mat(),
-             g_hist, 1, &hist_size, &hist_range, uniform, accumulate);
-    calcHist(&src_comp[2], 1, 0, Mat(),
-             r_hist, 1, &hist_size, &hist_range, uniform, accumulate);
-
-    // normalize the histogram per channel
     int hist_w = 512, hist_h = 256;
     int bin_w = cvRound((double)hist_w / hist_size);
     Mat hist_image(hist_h, hist_w, CV_8UC3, Scalar(0, 0, 0));
-    normalize(b_hist, b_hist, 0, hist_image.rows, NORM_MINMAX, -1, Mat());
-    normalize(g_hist, g_hist, 0, hist_image.rows, NORM_MINMAX, -1, Mat());
-    normalize(r_hist, r_hist, 0, hist_image.rows, NORM_MINMAX, -1, Mat());
-
-    // draw the histogram image
-    for (int i = 1; i < hist_size; i++) {
-        line(hist_image,
-             Point(bin_w*(i-1), hist_h - cvRound(b_hist.at<float>(i-1))),
-             Point(bin_w*(i), hist_h - cvRound(b_hist.at<float>(i))),
-             b, 2, 8, 0);
-        line(hist_image,
-             Point(bin_w*(i-1), hist_h - cvRound(g_hist.at<float>(i-1))),
-             Point(bin_w*(i), hist_h - cvRound(g_hist.at<float>(i))),
-             g, 2, 8, 0);
-        line(hist_image,
-             Point(bin_w*(i-1), hist_h - cvRound(r_hist.at<float>(i-1))),
-             Point(bin_w*(i), hist_h - cvRound(r_hist.at<float>(i))),
-             r, 2, 8, 0);
+
+    for (int c = 0; c < colors.size(); c++) {
+        // normalize the histogram (same as NORM_MINMAX to [0,hist_h])
+        const vector<unsigned> &hist = hists[c];
+        unsigned lo = *std::min_element(hist.begin(), hist.end());
+        unsigned hi = *std::max_element(hist.begin(), hist.end());
+        double scale = hi > lo ? (double)hist_image.rows / (hi - lo) : 0;
+
+        // draw the histogram image
+        for (int i = 1; i < hist_size; i++) {
+            line(hist_image,
+                 Point(bin_w*(i-1), hist_h - cvRound((hist[i-1] - lo) * scale)),
+                 Point(bin_w*(i), hist_h - cvRound((hist[i] - lo) * scale)),
+                 colors[c], 2, 8, 0);
+        }
     }
     return hist_image;
 }
@@ -469,7 +1469,137 @@ void ImgineContext::wait_key_press(ImgineContext *context)
     context->debug("All windows closed. GUI off.\n");
 }
 
+/** Render loop of inspect (blocking).
+ *  Mouse events only record the latest pointer position; the frame is drawn
+ *  here at most config.frame_rate times per second, so a fast drag costs one
+ *  render per frame instead of one per event. The loop blocks in waitKey()
+ *  between frames rather than polling.
+ */
+void ImgineContext::run_inspect_loop()
+{
+    int64 frame_ticks = (int64)(getTickFrequency() / max(1, config.frame_rate));
+    int64 last_frame = 0;
+    string window_name = active_canvas->name;
+
+    while (true) {
+        // dispatch the mouse events until the next frame is due; idle, wait
+        // a whole frame (events arriving meanwhile are drawn the frame after)
+        int64 wait_ticks = frame_ticks;
+        if (state.is_frame_dirty)
+            wait_ticks = last_frame + frame_ticks - getTickCount();
+        int wait_ms = (int)(wait_ticks * 1000 / getTickFrequency());
+        int code = waitKey(max(1, wait_ms));
+
+        if (code == 27 // ESC
+            || getWindowProperty(window_name, WND_PROP_AUTOSIZE) < 0) // closed
+            break;
+
+        finish_jobs(); // (swaps in full-resolution results)
+
+        if (state.is_frame_dirty && getTickCount() - last_frame >= frame_ticks) {
+            last_frame = getTickCount();
+            render_inspect_frame();
+        }
+    }
+
+    // Must call this explicitly, otherwise windows would hang.
+    destroyAllWindows();
+
+    state.is_gui_on = false;
+    debug("All windows closed. GUI off.\n");
+}
+
+/** Copy the 1-px outline of the rectangle from src to dst (same size).
+ */
+static void copy_outline(const Mat &src, Mat &dst, Rect r)
+{
+    if (r.area() <= 0)
+        return;
+    Rect strips[] = {
+        Rect(r.x, r.y, r.width, 1),                  // top
+        Rect(r.x, r.y + r.height - 1, r.width, 1),   // bottom
+        Rect(r.x, r.y, 1, r.height),                 // left
+        Rect(r.x + r.width - 1, r.y, 1, r.height)    // right
+    };
+    for (Rect &strip : strips) {
+        Mat dst_strip = dst(strip);
+        src(strip).copyTo(dst_strip);
+    }
+}
+
+/** Draw one inspect frame from the latest pointer position and ROI, then
+ *  record the latency since the oldest event it covers.
+ */
+void ImgineContext::render_inspect_frame()
+{
+    Mat *mat = active_canvas->current->mat;
+    Rect2d *roi = &active_canvas->current->roi;
+
+    vector<string> s_pixel = show_pixel(mat, state.pointer_x, state.pointer_y);
+    cout << cpl(s_pixel.size() - 1); // no newline after color-line
+
+    if (state.is_roi_dirty) {
+        // Restore the pixels under the previous outline, then draw the new
+        // one: O(ROI perimeter) instead of a full clone per frame.
+        copy_outline(*mat, display_buffer, display_outline);
+        display_outline = Rect();
+        if (roi->width < mat->cols || roi->height < mat->rows) {
+            display_outline = Rect(*roi) & Rect(0, 0, mat->cols, mat->rows);
+            rectangle(display_buffer, display_outline, Scalar(0, 0, 255), 1);
+        }
+        imshow(active_canvas->name, display_buffer);
+
+        if (state.is_histogram_enabled) {
+            Mat hist_image = draw_histogram(active_canvas->current);
+            imshow(get_histogram_name(active_canvas->name), hist_image);
+        }
+
+        vector<string> s_statistics = show_statistics(active_canvas->current);
+        cout << cpl(s_statistics.size() + 1);
+
+        cout << el(0) << "  Current ROI:\t" << *roi
+             << (active_canvas->current->is_approximate ? "  (approx.)" : "")
+             << endl;
+        for (string &line : s_statistics)
+            cout << el(0) << line << endl;
+    }
+
+    for (int i = 0; i < s_pixel.size() - 1; i++)
+        cout << el(0) << s_pixel[i] << endl;
+    cout << el(0) << s_pixel.back() << flush; // color-line
+
+    frame_latencies.push_back((getTickCount() - state.pending_since) * 1000. /
+                              getTickFrequency());
+    state.is_frame_dirty = false;
+    state.is_roi_dirty = false;
+}
+
+/** Return a string list presenting the event-to-frame latency percentiles
+ *  of the last inspect session (empty if no frame was drawn).
+ */
+vector<string> ImgineContext::show_frame_latency()
+{
+    vector<string> ret;
+    if (frame_latencies.empty())
+        return ret;
+
+    vector<double> sorted = frame_latencies;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&sorted](double p) {
+        return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    };
+
+    stringstream buf;
+    buf << std::fixed << std::setprecision(2)
+        << "p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99)
+        << " ms, max " << sorted.back() << " ms (" << sorted.size()
+        << " frames)";
+    ret.push_back("  Frame latency:\t" + buf.str());
+    return ret;
+}
+
 /** Mouse event handler (callback).
+ *  Only records the event; drawing is left to render_inspect_frame.
  */
 void ImgineContext::on_mouse_event(int ev, int x, int y, int flags, void *c)
 {
@@ -484,47 +1614,20 @@ void ImgineContext::on_mouse_event(int ev, int x, int y, int flags, void *c)
     switch (ev) {
     case EVENT_MOUSEMOVE:
     {
-        vector<string> s_pixel = context->show_pixel(mat, x, y);
-        cout << cpl(s_pixel.size() - 1); // no newline after color-line
-
         if (context->state.is_dragging) {
             int topleft_x = min(x, context->state.dragging_start_x);
             int topleft_y = min(y, context->state.dragging_start_y);
             int w = abs(x - context->state.dragging_start_x) + 1;
             int h = abs(y - context->state.dragging_start_y) + 1;
             *roi = Rect2d(topleft_x, topleft_y, w, h);
-
-            Mat masked_mat = mat->clone();
-            rectangle(masked_mat, *roi, Scalar(0, 0, 255), 1);
-            imshow(context->active_canvas->name, masked_mat);
-
-            Mat roi_mat(*mat, *roi);
-            if (context->state.is_histogram_enabled) {
-                Mat hist_image = context->draw_histogram(&roi_mat);
-                imshow(get_histogram_name(context->active_canvas->name),
-                       hist_image);
-            }
-
-            vector<string> s_statistics = context->show_statistics(&roi_mat);
-            cout << cpl(s_statistics.size() + 1);
-
-            cout << el(0) << "  Current ROI:\t" << *roi << endl;
-            for (string &line : s_statistics)
-                cout << el(0) << line << endl;
+            context->state.is_roi_dirty = true;
         }
-
-        for (int i = 0; i < s_pixel.size() - 1; i++)
-            cout << el(0) << s_pixel[i] << endl;
-        cout << el(0) << s_pixel.back() << flush; // color-line
     }
     break;
 
     case EVENT_LBUTTONDOWN:
     {
         if (!context->state.is_dragging) {
-            vector<string> s_pixel = context->show_pixel(mat, x, y);
-            cout << cpl(s_pixel.size() - 1); // no newline after color-line
-
             context->state.is_dragging = true;
             context->state.dragging_start_x = x;
             context->state.dragging_start_y = y;
@@ -532,26 +1635,7 @@ void ImgineContext::on_mouse_event(int ev, int x, int y, int flags, void *c)
             // Reset ROI selection.
             *roi = Rect2d(0, 0, context->active_canvas->cols,
                           context->active_canvas->rows);
-
-            imshow(context->active_canvas->name, *mat);
-
-            Mat roi_mat(*mat, *roi);
-            if (context->state.is_histogram_enabled) {
-                Mat hist_image = context->draw_histogram(&roi_mat);
-                imshow(get_histogram_name(context->active_canvas->name),
-                       hist_image);
-            }
-
-            vector<string> s_statistics = context->show_statistics(&roi_mat);
-            cout << cpl(s_statistics.size() + 1);
-
-            cout << el(0) << "  Current ROI:\t" << *roi << endl;
-            for (string &line : s_statistics)
-                cout << el(0) << line << endl;
-
-            for (int i = 0; i < s_pixel.size() - 1; i++)
-                cout << el(0) << s_pixel[i] << endl;
-            cout << el(0) << s_pixel.back() << flush; // color-line
+            context->state.is_roi_dirty = true;
         }
     }
     break;
@@ -562,9 +1646,19 @@ void ImgineContext::on_mouse_event(int ev, int x, int y, int flags, void *c)
             context->state.is_dragging = false;
         }
     }
-    break;
+    return;
 
     // TODO: EVENT_RBUTTONDOWN EVENT_MBUTTONDOWN
+    default:
+        return;
+    }
+
+    // coalesce: keep the latest position, remember when the frame went stale
+    context->state.pointer_x = x;
+    context->state.pointer_y = y;
+    if (!context->state.is_frame_dirty) {
+        context->state.is_frame_dirty = true;
+        context->state.pending_since = getTickCount();
     }
 }
 
@@ -580,6 +1674,37 @@ string ImgineContext::get_histogram_name(string canvas_name)
 void ImgineContext::execute_status(vector<string> params)
 {
     cout << "  Number of canvases:\t" << canvases.size() << endl;
+    cout << "  Threads:\t\t" << config.threads << endl;
+    size_t resident = 0, spilled = 0;
+    int spilled_canvases = 0;
+    for (Canvas *canvas : canvases) {
+        resident += canvas->resident_bytes();
+        if (canvas->is_spilled) {
+            spilled += (size_t)canvas->rows * canvas->cols *
+                       CV_ELEM_SIZE(canvas->cv_type);
+            spilled_canvases++;
+        }
+    }
+    cout << "  Resident memory:\t" << (resident >> 20) << " MiB";
+    if (config.memory_budget)
+        cout << " (budget " << (config.memory_budget >> 20) << " MiB)";
+    cout << endl;
+    cout << "  Spilled memory:\t" << (spilled >> 20) << " MiB ("
+         << spilled_canvases << " canvases)" << endl;
+    if (allocator) {
+        PoolStats stats = allocator->stats();
+        cout << "  Buffer pool:\t\t" << stats.hits << " hits, "
+             << stats.misses << " misses" << endl;
+        cout << "  Pooled memory:\t" << (stats.used_bytes >> 20)
+             << " MiB in use, " << (stats.cached_bytes >> 20)
+             << " MiB cached" << endl;
+    }
+    cout << "  Background jobs:\t" << jobs.size() << endl;
+    cout << "  Tile cache:\t\t" << (tile_cache.used_bytes() >> 20) << " / "
+         << (tile_cache.max_bytes >> 20) << " MiB, "
+         << tile_cache.count_loads() << " loads" << endl;
+    for (string &line : show_frame_latency())
+        cout << line << endl;
 }
 
 /** List:
@@ -597,7 +1722,19 @@ void ImgineContext::execute_list(vector<string> params)
                 int channels = get<0>(IMG_CV_TYPES.at(canvas->cv_type));
                 int depth = get<1>(IMG_CV_TYPES.at(canvas->cv_type));
                 cout << channels << " channels x "
-                     << depth << " bits / px" << endl;
+                     << depth << " bits / px"
+                     << (canvas->is_spilled ? " (spilled)" : "");
+                if (canvas->preview_scale > 1)
+                    cout << " (preview 1/" << canvas->preview_scale << ")";
+                if (canvas->lazy)
+                    cout << " (lazy)";
+                cout << endl;
+            }
+        } else if (scmd == "procedures" || scmd == "p") {
+            for (const auto &entry : registered_procedures()) {
+                const Procedure &proc = entry.second;
+                cout << "  " << proc.usage() << endl;
+                cout << "    (" << proc.capabilities() << ")" << endl;
             }
         } else {
             err("Unknown subcommand.\n");
@@ -677,6 +1814,10 @@ void ImgineContext::execute_delete(vector<string> params)
 
         for (auto &canvas : canvases) {
             if (canvas->name == canvas_name) {
+                if (canvas->tiled && !jobs.empty()) {
+                    cout << "  Waiting for background jobs..." << endl;
+                    wait_jobs(-1); // (may read its tiled image)
+                }
                 if (active_canvas == canvas)
                     active_canvas = nullptr;
                 canvases.remove(canvas);
@@ -711,14 +1852,39 @@ void ImgineContext::execute_rename(vector<string> params)
 }
 
 /** Import:
- *  Imports an image from a file into a new canvas.
+ *  Imports images from files, each into a new canvas.
+ *  Several files are decoded concurrently on the thread pool, in batches,
+ *  then put into canvases in the order given; a file that fails is reported
+ *  and skipped.
  */
 void ImgineContext::execute_import(vector<string> params)
 {
+    // REDUCED=2|4|8 imports previews, decoded at 1/2, 1/4 or 1/8 scale
+    int reduction = 1;
+    for (auto it = params.begin(); it != params.end(); ) {
+        if (boost::starts_with(*it, "REDUCED=")) {
+            try {
+                reduction = boost::lexical_cast<int>(it->substr(8));
+            } catch (boost::bad_lexical_cast &) {
+                reduction = 0;
+            }
+            if (reduction != 2 && reduction != 4 && reduction != 8) {
+                err("Invalid subparameter(s).\n");
+                return;
+            }
+            it = params.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // (a second parameter that is a number is the number of channels)
+    bool has_channels = params.size() == 3 &&
+        std::all_of(params.at(2).begin(), params.at(2).end(), ::isdigit);
+
     if (params.size() > 1) {
-        string file_name = params.at(1);
         int cv_flag = -1; // default: load image as is, incl. alpha channel
-        if (params.size() > 2) {
+        if (has_channels) {
             int channels = 0;
             stringstream(params.at(2)) >> channels;
             if (channels == 4) {
@@ -732,33 +1898,269 @@ void ImgineContext::execute_import(vector<string> params)
                 return;
             }
         }
+        vector<string> file_names(params.begin() + 1,
+                                  has_channels ? params.end() - 1
+                                               : params.end());
+
+        // decode a batch at a time, so that the memory budget can be kept
+        int batch_size = 4 * (pool.size() + 1);
+        int imported = 0;
+        for (size_t begin = 0; begin < file_names.size();
+             begin += batch_size) {
+            size_t end = min(file_names.size(), begin + batch_size);
+            vector<Mat> mats(end - begin);
+            vector<char> is_tiled(end - begin), is_mapped(end - begin);
+
+            pool.parallel_for(end - begin, [&](int i) {
+                const string &file_name = file_names.at(begin + i);
+                if (TiledImage::is_tiled_file(file_name)) {
+                    is_tiled[i] = true; // opened below, not decoded
+                    return;
+                }
+                try {
+                    bool mapped = false;
+                    mats[i] = read_image(file_name, cv_flag, reduction,
+                                         mapped);
+                    is_mapped[i] = mapped;
+                } catch (exception &e) {
+                    mats[i].release(); // (corrupt file)
+                }
+            });
 
-        new_canvas();
-        *active_canvas->current->mat = imread(file_name, cv_flag);
-        if (active_canvas->current->mat->data) {
-            int rows = active_canvas->current->mat->rows;
-            int cols = active_canvas->current->mat->cols;
-            int cv_type = active_canvas->current->mat->type();
-            active_canvas->current->roi = Rect2d(0, 0, cols, rows);
-            // TODO: rename canvas
-            active_canvas->rows = rows;
-            active_canvas->cols = cols;
-            active_canvas->cv_type = cv_type;
-            cout << "  Imported file:\t" << file_name << endl;
+            for (size_t i = 0; i < mats.size(); i++) {
+                string file_name = file_names.at(begin + i);
+                if (is_tiled[i]) {
+                    imported += import_tiled(file_name);
+                } else {
+                    if (is_mapped[i])
+                        debug("Mapped file %s\n", file_name.c_str());
+                    imported += import_mat(mats[i], file_name);
+                    if (reduction > 1 && active_canvas)
+                        mark_preview(active_canvas, file_name, cv_flag,
+                                     reduction);
+                }
+                mats[i].release();
+            }
+            enforce_memory_budget();
+        }
 
-        } else {
-            canvases.remove(active_canvas);
-            delete active_canvas;
-            active_canvas = nullptr;
-            err("Import failed.\n");
+        if (file_names.size() > 1)
+            cout << "  Imported " << imported << " of " << file_names.size()
+                 << " files." << endl;
+    } else {
+        warn("? :import FILE_NAME [CHANNELS] [REDUCED=2|4|8] |"
+             " :import FILE_NAME... [REDUCED=2|4|8]\n");
+    }
+}
+
+/** Read an image file: uncompressed formats are mapped as they are, others
+ *  decoded. (may run on any thread)
+ *  With a reduction, the decoder is asked for a 1/2, 1/4 or 1/8 scale image
+ *  (JPEG decodes it natively, at a fraction of the cost); mapped images, and
+ *  decoders that cannot, are scaled down after reading. Reduced images are
+ *  always 8-bit color or grayscale. (no alpha channel)
+ */
+Mat ImgineContext::read_image(string file_name, int cv_flag, int reduction,
+                              bool &is_mapped)
+{
+    Mat mat = map_image(file_name);
+    if (!mat.empty() && cv_flag >= 0 && mat.channels() != (cv_flag ? 3 : 1))
+        mat.release();
+    is_mapped = !mat.empty();
+    if (mat.empty() && reduction > 1) {
+        int reduced_flag = cv_flag == 0 ? IMREAD_GRAYSCALE : IMREAD_COLOR;
+        switch (reduction) {
+        case 2: reduced_flag |= IMREAD_REDUCED_GRAYSCALE_2; break;
+        case 4: reduced_flag |= IMREAD_REDUCED_GRAYSCALE_4; break;
+        case 8: reduced_flag |= IMREAD_REDUCED_GRAYSCALE_8; break;
+        }
+        mat = imread(file_name, reduced_flag);
+    } else if (mat.empty()) {
+        mat = imread(file_name, cv_flag);
+    }
+
+    // (fallback) scale down what was read at full resolution
+    if (reduction > 1 && !mat.empty() && is_mapped) {
+        Mat reduced;
+        resize(mat, reduced, Size((mat.cols + reduction - 1) / reduction,
+                                  (mat.rows + reduction - 1) / reduction),
+               0, 0, INTER_AREA);
+        mat = reduced;
+    }
+    return mat;
+}
+
+/** Mark an imported canvas as a preview of a file, decoded at reduced scale.
+ *  (the full-resolution image is to be decoded the way the preview was:
+ *  reduced decoding yields 8-bit grayscale or color only)
+ */
+void ImgineContext::mark_preview(Canvas *canvas, string file_name, int cv_flag,
+                                 int reduction)
+{
+    canvas->preview_scale = reduction;
+    canvas->source_file = file_name;
+    canvas->source_flag = cv_flag;
+    if (CV_MAT_CN(canvas->cv_type) == 1)
+        canvas->source_flag = IMREAD_GRAYSCALE;
+    else if (CV_MAT_CN(canvas->cv_type) == 3)
+        canvas->source_flag = IMREAD_COLOR;
+    canvas->source_state = canvas->current->id;
+    cout << "  Preview:\t1/" << reduction << " scale" << endl;
+}
+
+/** Replace a preview canvas by the full-resolution image of its file, with
+ *  the ROI scaled accordingly. A preview that has been edited (its current
+ *  state is not the imported one, or edits may be redone) is kept as it is.
+ *  (returns false if the canvas is still a preview)
+ */
+bool ImgineContext::upgrade_preview(Canvas *canvas)
+{
+    if (canvas->preview_scale <= 1)
+        return true;
+    if (canvas->current->id != canvas->source_state ||
+        canvas->history.size() > 1) {
+        warn("Canvas %s is an edited preview; not upgraded.\n",
+             canvas->name.c_str());
+        return false;
+    }
+
+    bool is_mapped;
+    Mat mat = read_image(canvas->source_file, canvas->source_flag, 1,
+                         is_mapped);
+    if (mat.empty()) {
+        err("Cannot upgrade canvas %s from %s\n", canvas->name.c_str(),
+            canvas->source_file.c_str());
+        return false;
+    }
+    if (mat.type() != canvas->cv_type) {
+        err("Cannot upgrade canvas %s: %s decodes to another type.\n",
+            canvas->name.c_str(), canvas->source_file.c_str());
+        return false;
+    }
+
+    CanvasState *state = canvas->current;
+    double fx = (double)mat.cols / canvas->cols;
+    double fy = (double)mat.rows / canvas->rows;
+    Rect2d roi = state->roi;
+    state->set_mat(mat);
+    state->roi = Rect2d(roi.x * fx, roi.y * fy, roi.width * fx,
+                        roi.height * fy) & Rect2d(0, 0, mat.cols, mat.rows);
+    canvas->rows = mat.rows;
+    canvas->cols = mat.cols;
+    canvas->cv_type = mat.type();
+    canvas->preview_scale = 1;
+    debug("Upgraded canvas %s to full resolution.\n", canvas->name.c_str());
+    return true;
+}
+
+/** Import Raw:
+ *  Maps an uncompressed 8-bit image from a raw file into a new canvas.
+ */
+void ImgineContext::execute_import_raw(vector<string> params)
+{
+    if (params.size() == 5 || params.size() == 6) {
+        string file_name = params.at(1);
+        int cols, rows, channels;
+        size_t offset = 0;
+        try {
+            cols = boost::lexical_cast<int>(params.at(2));
+            rows = boost::lexical_cast<int>(params.at(3));
+            channels = boost::lexical_cast<int>(params.at(4));
+            if (params.size() == 6)
+                offset = boost::lexical_cast<size_t>(params.at(5));
+        } catch (boost::bad_lexical_cast &) {
+            err("Invalid parameter(s).\n");
+            return;
         }
+
+        import_mat(map_raw(file_name, cols, rows, channels, offset),
+                   file_name);
+    } else {
+        warn("? :import_raw FILE_NAME COLS ROWS CHANNELS [OFFSET]\n");
+    }
+}
+
+/** Put an imported image matrix into a new canvas. (fails if empty)
+ */
+bool ImgineContext::import_mat(Mat mat, string file_name)
+{
+    new_canvas();
+    active_canvas->current->set_mat(mat);
+    if (active_canvas->current->mat->data) {
+        int rows = active_canvas->current->mat->rows;
+        int cols = active_canvas->current->mat->cols;
+        int cv_type = active_canvas->current->mat->type();
+        active_canvas->current->roi = Rect2d(0, 0, cols, rows);
+        // TODO: rename canvas
+        active_canvas->rows = rows;
+        active_canvas->cols = cols;
+        active_canvas->cv_type = cv_type;
+        cout << "  Imported file:\t" << file_name << endl;
+        return true;
+
     } else {
-        warn("? :import FILE_NAME [CHANNELS]\n");
+        canvases.remove(active_canvas);
+        delete active_canvas;
+        active_canvas = nullptr;
+        err("Import failed: %s\n", file_name.c_str());
+        return false;
     }
 }
 
+/** Open a tiled image file (.imgt) as a new tiled canvas. Tiles are read
+ *  on demand through the tile cache.
+ */
+bool ImgineContext::import_tiled(string file_name)
+{
+    TiledImage *image = TiledImage::open(file_name, &tile_cache);
+    if (!image) {
+        err("Import failed: %s\n", file_name.c_str());
+        return false;
+    }
+
+    new_canvas();
+    active_canvas->tiled = image;
+    active_canvas->rows = image->rows;
+    active_canvas->cols = image->cols;
+    active_canvas->cv_type = image->type;
+    active_canvas->current->roi = Rect2d(0, 0, image->cols, image->rows);
+    cout << "  Imported file:\t" << file_name << " (tiled)" << endl;
+    return true;
+}
+
+/** Make sure the whole image of the canvas is in memory, for commands that
+ *  need it: a lazy canvas is evaluated, a tiled canvas is an error. (returns
+ *  false after printing it)
+ */
+bool ImgineContext::require_pixels(Canvas *canvas)
+{
+    materialize(canvas);
+    if (!canvas->tiled)
+        return true;
+    err("Not supported on tiled canvas %s.\n", canvas->name.c_str());
+    return false;
+}
+
+/** Evaluate the whole image of a lazy canvas, which becomes a plain canvas.
+ */
+void ImgineContext::materialize(Canvas *canvas)
+{
+    if (!canvas->lazy)
+        return;
+    Mat mat = canvas->lazy->evaluate(Rect(0, 0, canvas->cols, canvas->rows),
+                                     &pool);
+    Rect2d roi = canvas->current->roi;
+    canvas->current->set_mat(mat);
+    canvas->current->roi = roi;
+    canvas->lazy.reset();
+    debug("Evaluated lazy canvas %s.\n", canvas->name.c_str());
+}
+
 /** Export:
  *  Exports the image from the active canvas to a file.
+ *  A tiled canvas can be exported to .imgt or binary PGM/PPM only; any canvas
+ *  can be exported to .imgt. Other canvases are encoded in the background.
+ *  (see :jobs and :wait)
  */
 void ImgineContext::execute_export(vector<string> params)
 {
@@ -795,12 +2197,32 @@ void ImgineContext::execute_export(vector<string> params)
                 err("Invalid subparameter(s).\n");
                 return;
             }
-        }
+        }
+
+        if (active_canvas) {
+            upgrade_preview(active_canvas); // (exports are full resolution)
+            materialize(active_canvas);
+            bool is_tiled_file = boost::ends_with(file_name, ".imgt");
+            bool is_pnm_file = boost::ends_with(file_name, ".pgm") ||
+                               boost::ends_with(file_name, ".ppm") ||
+                               boost::ends_with(file_name, ".pnm");
+            if (active_canvas->tiled && !is_tiled_file && !is_pnm_file) {
+                err("Tiled canvases export to .imgt, .pgm or .ppm only.\n");
+                return;
+            }
 
-        if (active_canvas) {
             try {
-                imwrite(file_name, *(active_canvas->current->mat), cv_params);
-                cout << "  Exported file:\t" << file_name << endl;
+                bool is_ok = true;
+                if (active_canvas->tiled && is_tiled_file)
+                    is_ok = active_canvas->tiled->save_as(file_name);
+                else if (active_canvas->tiled)
+                    is_ok = export_pnm(active_canvas->tiled, file_name);
+                else
+                    is_ok = export_async(file_name, cv_params, is_tiled_file);
+                if (is_ok && active_canvas->tiled)
+                    cout << "  Exported file:\t" << file_name << endl;
+                else if (!is_ok)
+                    err("Export failed.\n");
             } catch (exception &e) {
                 err("Export failed:\n%s", e.what());
             }
@@ -814,6 +2236,30 @@ void ImgineContext::execute_export(vector<string> params)
     }
 }
 
+/** Queue the export of the current state of the active canvas as a
+ *  background job. The job encodes a snapshot, (sharing the buffer, which
+ *  states never modify) so the canvas may change meanwhile.
+ */
+bool ImgineContext::export_async(string file_name, vector<int> cv_params,
+                                 bool is_tiled_file)
+{
+    Mat snapshot = *(active_canvas->current->mat);
+    if (snapshot.empty())
+        return false;
+
+    Job *job = start_job("export " + active_canvas->name + " to " + file_name,
+                         [snapshot, file_name, cv_params, is_tiled_file]() {
+        bool is_ok = is_tiled_file ?
+            TiledImage::write_file(file_name, snapshot) :
+            imwrite(file_name, snapshot, cv_params);
+        if (!is_ok)
+            throw std::runtime_error("cannot write " + file_name);
+    });
+    cout << "  Exporting file:\t" << file_name << " (job " << job->id << ")"
+         << endl;
+    return true;
+}
+
 /** Properties:
  *  Prints the image properties of the canvas.
  */
@@ -875,6 +2321,8 @@ void ImgineContext::execute_dump(vector<string> params)
             Canvas *target_canvas;
             target_canvas = get_canvas_by_name(canvas_name);
             if (target_canvas) {
+                if (!require_pixels(target_canvas))
+                    continue;
                 cout << format(*(target_canvas->current->mat),
                                Formatter::FMT_PYTHON) << endl;
             } else {
@@ -882,6 +2330,8 @@ void ImgineContext::execute_dump(vector<string> params)
             }
         }
     } else if (active_canvas) {
+        if (!require_pixels(active_canvas))
+            return;
         cout << format(*(active_canvas->current->mat),
                        Formatter::FMT_PYTHON) << endl;
     } else {
@@ -900,16 +2350,18 @@ void ImgineContext::execute_dump_roi(vector<string> params)
             Canvas *target_canvas;
             target_canvas = get_canvas_by_name(canvas_name);
             if (target_canvas) {
-                Mat roi(*(target_canvas->current->mat),
-                        target_canvas->current->roi);
+                if (target_canvas->tiled && !require_pixels(target_canvas))
+                    continue;
+                Mat roi = roi_pixels(target_canvas);
                 cout << format(roi, Formatter::FMT_PYTHON) << endl;
             } else {
                 err("Canvas not found: %s\n", canvas_name.c_str());
             }
         }
     } else if (active_canvas) {
-        Mat roi(*(active_canvas->current->mat),
-                active_canvas->current->roi);
+        if (active_canvas->tiled && !require_pixels(active_canvas))
+            return;
+        Mat roi = roi_pixels(active_canvas);
         cout << format(roi, Formatter::FMT_PYTHON) << endl;
     } else {
         err("No active canvas.\n");
@@ -930,9 +2382,7 @@ void ImgineContext::execute_statistics(vector<string> params)
                 cout << "  Current ROI:\t" << target_canvas->current->roi
                      << endl;
 
-                Mat roi(*(target_canvas->current->mat),
-                        target_canvas->current->roi);
-                for (string &line : show_statistics(&roi))
+                for (string &line : show_statistics(target_canvas))
                     cout << line << endl;
             } else {
                 err("Canvas not found: %s\n", canvas_name.c_str());
@@ -942,9 +2392,7 @@ void ImgineContext::execute_statistics(vector<string> params)
         cout << "  Current ROI:\t" << active_canvas->current->roi
              << endl;
 
-        Mat roi(*(active_canvas->current->mat),
-                active_canvas->current->roi);
-        for (string &line : show_statistics(&roi))
+        for (string &line : show_statistics(active_canvas))
             cout << line << endl;
     } else {
         err("No active canvas.\n");
@@ -965,6 +2413,8 @@ void ImgineContext::execute_show(vector<string> params)
             Canvas *target_canvas;
             target_canvas = get_canvas_by_name(canvas_name);
             if (target_canvas) {
+                if (!require_pixels(target_canvas))
+                    continue;
                 // FIXME: resizable window using CV_WINDOW_NORMAL
                 namedWindow(target_canvas->name, WINDOW_AUTOSIZE);
                 imshow(target_canvas->name, *(target_canvas->current->mat));
@@ -978,6 +2428,8 @@ void ImgineContext::execute_show(vector<string> params)
             threads.push_back(thread(wait_key_press, this));
         }
     } else if (active_canvas) {
+        if (!require_pixels(active_canvas))
+            return;
         // FIXME: resizable window using CV_WINDOW_NORMAL
         namedWindow(active_canvas->name, WINDOW_AUTOSIZE);
         imshow(active_canvas->name, *(active_canvas->current->mat));
@@ -1003,9 +2455,7 @@ void ImgineContext::execute_histogram(vector<string> params)
             Canvas *target_canvas;
             target_canvas = get_canvas_by_name(canvas_name);
             if (target_canvas) {
-                Mat roi(*(target_canvas->current->mat),
-                        target_canvas->current->roi);
-                Mat hist_image = draw_histogram(&roi);
+                Mat hist_image = draw_histogram(target_canvas);
 
                 // FIXME: resizable window using CV_WINDOW_NORMAL
                 imshow(get_histogram_name(target_canvas->name), hist_image);
@@ -1020,9 +2470,7 @@ void ImgineContext::execute_histogram(vector<string> params)
             threads.push_back(thread(wait_key_press, this));
         }
     } else if (active_canvas) {
-        Mat roi(*(active_canvas->current->mat),
-                active_canvas->current->roi);
-        Mat hist_image = draw_histogram(&roi);
+        Mat hist_image = draw_histogram(active_canvas);
 
         // FIXME: resizable window using CV_WINDOW_NORMAL
         imshow(get_histogram_name(active_canvas->name), hist_image);
@@ -1054,6 +2502,8 @@ void ImgineContext::execute_inspect(vector<string> params,
     }
 
     if (active_canvas) {
+        if (!require_pixels(active_canvas))
+            return;
         // FIXME: resizable window using CV_WINDOW_NORMAL
         namedWindow(active_canvas->name, WINDOW_AUTOSIZE);
         imshow(active_canvas->name, *(active_canvas->current->mat));
@@ -1061,7 +2511,9 @@ void ImgineContext::execute_inspect(vector<string> params,
         for (string &line : show_properties(active_canvas))
             cout << line << endl;
 
-        cout << "  Current ROI:\t" << active_canvas->current->roi << endl;
+        cout << "  Current ROI:\t" << active_canvas->current->roi
+             << (active_canvas->current->is_approximate ? "  (approx.)" : "")
+             << endl;
         Mat roi(*(active_canvas->current->mat), active_canvas->current->roi);
         for (string &line : show_statistics(&roi))
             cout << line << endl;
@@ -1078,16 +2530,28 @@ void ImgineContext::execute_inspect(vector<string> params,
         if (has_histogram) {
             state.is_histogram_enabled = true;
 
-            Mat hist_image = draw_histogram(&roi);
+            Mat hist_image = draw_histogram(active_canvas->current);
             imshow(get_histogram_name(active_canvas->name), hist_image);
         } else {
             state.is_histogram_enabled = false;
         }
 
+        display_buffer = active_canvas->current->mat->clone();
+        display_outline = Rect();
+
         state.is_gui_on = true;
-        wait_key_press(this); // blocking
+        state.is_dragging = false;
+        state.is_frame_dirty = state.is_roi_dirty = false;
+        frame_latencies.clear();
+        run_inspect_loop(); // blocking
 
         cout << el(1) << endl; // remove color-line
+        for (string &line : show_frame_latency())
+            debug("%s\n", line.c_str());
+
+        // drop the integral images built for ROI statistics and histograms
+        active_canvas->current->release_cache();
+        display_buffer.release();
 
     } else {
         err("No active canvas.\n");
@@ -1096,102 +2560,802 @@ void ImgineContext::execute_inspect(vector<string> params,
 
 /** Procedure:
  */
-void ImgineContext::execute_procedure(vector<string> params)
+void ImgineContext::execute_procedure(vector<string> params,
+                                      bool is_progressive)
 {
+    // --inplace / --new and --lazy / --eager override the configured modes,
+    // a trailing & runs the procedure as a background job
+    bool is_inplace = config.is_inplace, is_lazy = config.is_lazy;
+    bool is_background = params.size() > 1 && params.back() == "&";
+    if (is_background)
+        params.pop_back();
+    for (auto it = params.begin(); it != params.end(); ) {
+        if (*it == "--inplace" || *it == "--new") {
+            is_inplace = *it == "--inplace";
+            it = params.erase(it);
+        } else if (*it == "--lazy" || *it == "--eager") {
+            is_lazy = *it == "--lazy";
+            it = params.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
     if (params.size() > 1) {
-        string scmd = params.at(1);
-        Mat result;
+        const Procedure *proc = find_procedure(params.at(1));
+        if (!proc) {
+            err("Unknown subcommand.\n");
+            return;
+        }
+        ProcedureArgs args;
+        if (!parse_procedure_args(proc, params, args))
+            return;
+        Canvas *src_canvas = args.canvases.front();
+        args.pool = &pool;
 
-        if (scmd == "grayscale") {
-            if (params.size() > 2) {
-                Canvas *src_canvas = get_canvas_by_name(params.at(2));
+        // pointwise procedures may be recorded, and evaluated on demand
+        if (is_lazy && !is_background && !is_inplace && proc->make_stage &&
+            !src_canvas->tiled) {
+            put_lazy_result(src_canvas, proc->make_stage(args));
+            return;
+        }
+        materialize(src_canvas);
+
+        if (is_background) {
+            if (is_inplace)
+                warn("Background results are put into a new canvas.\n");
+            if (!src_canvas->tiled || proc->is_tileable() ||
+                require_pixels(src_canvas))
+                run_background(proc, args);
+            return;
+        }
 
-                if (src_canvas) {
-                    result = algo_grayscale(src_canvas);
-                } else {
-                    err("Canvas not found.\n");
-                    return;
-                }
-            } else {
-                warn("? :procedure grayscale SRC_CANVAS\n");
+        // a large result to be inspected is previewed first
+        bool is_large = (double)src_canvas->rows * src_canvas->cols >
+                        PREVIEW_PIXELS;
+        bool is_tiled = std::any_of(args.canvases.begin(), args.canvases.end(),
+                                    [](Canvas *canvas) {
+                                        return canvas->tiled != nullptr;
+                                    });
+        if (is_progressive && is_large && !is_inplace && !is_tiled) {
+            run_progressive(proc, args);
+            return;
+        }
+
+        // choose how to run it: tiled (if the source is), into the recycled
+        // buffer (in-place mode), on the thread pool
+        Mat result;
+        TiledImage *tiled_result = nullptr; // (if the source is tiled)
+        if (src_canvas->tiled) {
+            if (!proc->is_tileable() && !require_pixels(src_canvas))
                 return;
-            }
+            args.tiled_file = scratch_file_name(
+                "tiled-" + to_string(++scratch_counter), ".imgt");
+            args.tile_cache = &tile_cache;
+            tiled_result = proc->run_tiled(args);
+        } else {
+            if (is_inplace && proc->is_inplace_safe)
+                args.recycled = src_canvas->take_spare_buffer();
+            result = proc->run(args);
+        }
 
-        } else if (scmd == "equalize_hist") {
-            if (params.size() > 2) {
-                Canvas *src_canvas = get_canvas_by_name(params.at(2));
-                Colorspace space = CIELAB;
-                if (params.size() > 3)
-                    try {
-                        space = COLORSPACE_STRINGS.at(params.at(3));
-                    } catch (const std::out_of_range &e) {
-                        err("Unknown colorspace.\n");
-                        return;
-                    }
-
-                if (src_canvas) {
-                    result = algo_equalize_hist(src_canvas, space);
-                } else {
-                    err("Canvas not found.\n");
-                    return;
-                }
-            } else {
-                warn("? :procedure equalize_hist SRC_CANVAS [COLORSPACE]\n");
+        // tiled results always go into a new tiled canvas (no history)
+        if (src_canvas->tiled) {
+            if (is_inplace)
+                warn("Tiled canvases have no history; result put into a new "
+                     "canvas.\n");
+            if (!tiled_result) {
+                err("Procedure failed.\n");
                 return;
             }
+            put_tiled_result(tiled_result);
+            return;
+        }
 
-        } else if (scmd == "color_transfer") {
-            if (params.size() > 3) {
-                Canvas *src_canvas = get_canvas_by_name(params.at(2));
-                Canvas *ref_canvas = get_canvas_by_name(params.at(3));
-                Colorspace space = Ruderman_lab;
-                if (params.size() > 4)
-                    try {
-                        space = COLORSPACE_STRINGS.at(params.at(4));
-                    } catch (const std::out_of_range &e) {
-                        err("Unknown colorspace.\n");
-                        return;
-                    }
-
-                if (src_canvas && ref_canvas) {
-                    result = algo_color_transfer(src_canvas, ref_canvas, space);
-                } else {
-                    err("Canvas not found.\n");
-                    return;
+        put_procedure_result(src_canvas, result, is_inplace);
+    } else {
+        warn("? :procedure ALGORITHM [PARAMS] [--inplace | --new]"
+             " [--lazy | --eager] [&] (see :list procedures)\n");
+    }
+}
+
+/** Append the result of a procedure to the history of the source canvas
+ *  (in-place), or put it into a new canvas.
+ */
+void ImgineContext::put_procedure_result(Canvas *src_canvas, Mat result,
+                                         bool is_inplace)
+{
+    // append result to the history of the source canvas
+    if (is_inplace && result.data) {
+        src_canvas->commit(result, Rect(0, 0, result.cols, result.rows));
+        src_canvas->trim_history(config.history_budget);
+        active_canvas = src_canvas;
+        cout << "  Canvas name:\t" << active_canvas->name << endl;
+        cout << "  Current state:\t" << active_canvas->current->id << endl;
+        return;
+    }
+
+    // put result into a new canvas
+    new_canvas();
+    active_canvas->current->set_mat(result);
+    if (active_canvas->current->mat->data) {
+        int rows = active_canvas->current->mat->rows;
+        int cols = active_canvas->current->mat->cols;
+        int cv_type = active_canvas->current->mat->type();
+        active_canvas->current->roi = Rect2d(0, 0, cols, rows);
+        // TODO: rename canvas
+        active_canvas->rows = rows;
+        active_canvas->cols = cols;
+        active_canvas->cv_type = cv_type;
+        cout << "  Canvas name:\t" << active_canvas->name << endl;
+
+    } else {
+        canvases.remove(active_canvas);
+        delete active_canvas;
+        active_canvas = nullptr;
+        err("Import failed.\n");
+    }
+}
+
+/** Put the result of a procedure on a tiled canvas into a new tiled canvas.
+ */
+void ImgineContext::put_tiled_result(TiledImage *tiled_result)
+{
+    new_canvas();
+    active_canvas->tiled = tiled_result;
+    active_canvas->rows = tiled_result->rows;
+    active_canvas->cols = tiled_result->cols;
+    active_canvas->cv_type = tiled_result->type;
+    active_canvas->current->roi = Rect2d(0, 0, tiled_result->cols,
+                                         tiled_result->rows);
+    cout << "  Canvas name:\t" << active_canvas->name << " (tiled)" << endl;
+}
+
+/** Run a procedure as a background job, on snapshots of the canvases. The
+ *  result is put into a new canvas once the job is done, (see reap_jobs)
+ *  without switching the active canvas.
+ */
+void ImgineContext::run_background(const Procedure *proc, ProcedureArgs &args)
+{
+    Canvas *src_canvas = args.canvases.front();
+    ProcedureArgs job_args = args;
+    vector<Canvas *> snapshots;
+    for (Canvas *&canvas : job_args.canvases) {
+        canvas = snapshot_canvas(canvas);
+        snapshots.push_back(canvas);
+    }
+    if (src_canvas->tiled) {
+        job_args.tiled_file = scratch_file_name(
+            "tiled-" + to_string(++scratch_counter), ".imgt");
+        job_args.tile_cache = &tile_cache;
+    }
+
+    auto result = std::make_shared<Mat>();
+    auto tiled_result = std::make_shared<TiledImage *>(nullptr);
+    Job *job = start_job(proc->name + " " + src_canvas->name,
+                         [proc, job_args, result, tiled_result]() {
+        ProcedureArgs run_args = job_args;
+        if (run_args.tiled_file.empty()) {
+            *result = proc->run(run_args);
+        } else {
+            *tiled_result = proc->run_tiled(run_args);
+            if (!*tiled_result)
+                throw std::runtime_error("cannot create " +
+                                         run_args.tiled_file);
+        }
+    });
+    job->on_finished = [this, job, result, tiled_result, snapshots]() {
+        delete_snapshots(snapshots);
+        if (!job->is_ok)
+            return;
+        Canvas *previous_canvas = active_canvas;
+        cout << "  Job " << job->id << " result:" << endl;
+        if (*tiled_result)
+            put_tiled_result(*tiled_result);
+        else
+            put_procedure_result(nullptr, *result, false);
+        active_canvas = previous_canvas;
+    };
+    cout << "  Started job:\t" << job->id << endl;
+}
+
+/** Run a procedure on a low level of the pyramid of the source, and put the
+ *  result, scaled up, into a new canvas as a preview (flagged approximate);
+ *  the full-resolution result is computed by a background job and swapped
+ *  in when it is ready. (see swap_full_result)
+ */
+void ImgineContext::run_progressive(const Procedure *proc, ProcedureArgs &args)
+{
+    Canvas *src_canvas = args.canvases.front();
+    Size size(src_canvas->cols, src_canvas->rows);
+    int level = 0;
+    while (level < PREVIEW_MAX_LEVEL &&
+           (double)size.area() / (1 << 2 * level) > PREVIEW_PIXELS)
+        level++;
+
+    // preview, on a canvas of the pyramid level (with the ROI scaled down)
+    Mat level_mat = src_canvas->current->pyramid_level(level);
+    double scale = (double)level_mat.cols / size.width;
+    Rect2d roi = src_canvas->current->roi;
+    Canvas level_canvas(src_canvas->id);
+    level_canvas.current->set_mat(level_mat);
+    level_canvas.current->roi = Rect2d(roi.x * scale, roi.y * scale,
+                                       max(1., roi.width * scale),
+                                       max(1., roi.height * scale));
+    level_canvas.rows = level_mat.rows;
+    level_canvas.cols = level_mat.cols;
+    level_canvas.cv_type = level_mat.type();
+
+    ProcedureArgs preview_args = args;
+    preview_args.canvases.front() = &level_canvas;
+    Mat preview;
+    resize(proc->run(preview_args), preview, size, 0, 0, INTER_LINEAR);
+    put_procedure_result(src_canvas, preview, false);
+    if (!active_canvas)
+        return;
+    active_canvas->current->is_approximate = true;
+    cout << "  Preview:\t1/" << (1 << level) << " scale" << endl;
+
+    // full resolution, in the background, on snapshots of the canvases
+    ProcedureArgs full_args = args;
+    vector<Canvas *> snapshots;
+    for (Canvas *&canvas : full_args.canvases) {
+        canvas = snapshot_canvas(canvas);
+        snapshots.push_back(canvas);
+    }
+    auto result = std::make_shared<Mat>();
+    Job *job = start_job(proc->name + " " + src_canvas->name +
+                         " at full resolution", [proc, full_args, result]() {
+        ProcedureArgs job_args = full_args;
+        *result = proc->run(job_args);
+    });
+    string id = active_canvas->id;
+    job->on_finished = [this, id, result, snapshots]() {
+        delete_snapshots(snapshots);
+        swap_full_result(id, *result);
+    };
+}
+
+/** Return a new canvas with the current image and ROI of a canvas, which
+ *  background jobs can read while the canvas changes. (shares the buffer,
+ *  or the tiled image, which tiled canvases never modify)
+ */
+Canvas *ImgineContext::snapshot_canvas(Canvas *canvas)
+{
+    Canvas *snapshot = new Canvas(canvas->id);
+    snapshot->current->set_mat(*(canvas->current->mat));
+    snapshot->current->roi = canvas->current->roi;
+    snapshot->tiled = canvas->tiled;
+    snapshot->rows = canvas->rows;
+    snapshot->cols = canvas->cols;
+    snapshot->cv_type = canvas->cv_type;
+    return snapshot;
+}
+
+/** Delete canvas snapshots. (not the tiled images they share)
+ */
+void ImgineContext::delete_snapshots(vector<Canvas *> snapshots)
+{
+    for (Canvas *snapshot : snapshots) {
+        snapshot->tiled = nullptr;
+        delete snapshot;
+    }
+}
+
+/** Replace the preview in a canvas by the full-resolution result, unless
+ *  the canvas was deleted or edited meanwhile. (redraws it if inspected)
+ */
+void ImgineContext::swap_full_result(string canvas_id, Mat result)
+{
+    Canvas *canvas = nullptr;
+    for (Canvas *c : canvases)
+        if (c->id == canvas_id)
+            canvas = c;
+    if (!canvas || !canvas->current->is_approximate || result.empty() ||
+        result.size() != Size(canvas->cols, canvas->rows) ||
+        !canvas->reload())
+        return;
+
+    Rect2d roi = canvas->current->roi;
+    canvas->current->set_mat(result);
+    canvas->current->roi = roi;
+    canvas->current->is_approximate = false;
+    canvas->cv_type = result.type();
+
+    if (state.is_gui_on && canvas == active_canvas) {
+        display_buffer = result.clone();
+        display_outline = Rect();
+        state.is_roi_dirty = true;
+        if (!state.is_frame_dirty) {
+            state.is_frame_dirty = true;
+            state.pending_since = getTickCount();
+        }
+    }
+}
+
+/** Put the deferred result of a pointwise procedure into a new lazy canvas,
+ *  with a full ROI, as an evaluated result would have. (the stage reduces
+ *  the ROI of the source; lazy sources are chained, not evaluated)
+ */
+void ImgineContext::put_lazy_result(Canvas *src_canvas, PointwiseStage *stage)
+{
+    auto lazy = std::make_shared<LazyImage>(
+        src_canvas->lazy ? Mat() : *(src_canvas->current->mat),
+        src_canvas->lazy, std::shared_ptr<PointwiseStage>(stage),
+        Rect(src_canvas->current->roi));
+
+    new_canvas();
+    active_canvas->lazy = lazy;
+    active_canvas->rows = lazy->size.height;
+    active_canvas->cols = lazy->size.width;
+    active_canvas->cv_type = lazy->type;
+    active_canvas->current->roi = Rect2d(0, 0, lazy->size.width,
+                                         lazy->size.height);
+    cout << "  Canvas name:\t" << active_canvas->name << " (lazy)" << endl;
+}
+
+/** Pipeline:
+ *  Runs a chain of procedures on a canvas, (e.g. "C1 grayscale |
+ *  equalize_hist") fused into as few passes over cache-sized tiles as their
+ *  reductions allow, with no intermediate canvases. With --compare, the
+ *  procedures are also run one by one, for the time and the difference.
+ */
+void ImgineContext::execute_pipeline(vector<string> params)
+{
+    bool is_inplace = config.is_inplace, is_compare = false;
+    for (auto it = params.begin(); it != params.end(); ) {
+        if (*it == "--inplace" || *it == "--new") {
+            is_inplace = *it == "--inplace";
+            it = params.erase(it);
+        } else if (*it == "--compare") {
+            is_compare = true;
+            it = params.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    const char *usage = "? :pipeline SRC_CANVAS ALGORITHM [PARAMS]"
+                        " [| ALGORITHM [PARAMS]]... [--inplace | --new]"
+                        " [--compare]\n";
+    if (params.size() < 3) {
+        warn(usage);
+        return;
+    }
+
+    Canvas *src_canvas = get_canvas_by_name(params.at(1));
+    if (!src_canvas) {
+        err("Canvas not found.\n");
+        return;
+    }
+    if (!require_pixels(src_canvas))
+        return;
+    upgrade_preview(src_canvas);
+
+    vector< vector<string> > steps(1);
+    for (size_t i = 2; i < params.size(); i++) {
+        if (params.at(i) == "|")
+            steps.push_back({});
+        else
+            steps.back().push_back(params.at(i));
+    }
+
+    // each step is parsed as ":procedure ALGORITHM SRC_CANVAS [PARAMS]", its
+    // source being of the type the previous step results in
+    vector<const Procedure *> procs;
+    vector<ProcedureArgs> step_args;
+    vector<PointwiseStage *> stages;
+    int type = src_canvas->cv_type;
+    bool is_ok = true;
+    for (auto &step : steps) {
+        if (step.empty()) {
+            warn(usage);
+            is_ok = false;
+            break;
+        }
+        const Procedure *proc = find_procedure(step.at(0));
+        if (!proc) {
+            err("Unknown procedure: %s\n", step.at(0).c_str());
+            is_ok = false;
+            break;
+        }
+        if (!proc->make_stage) {
+            err("Procedure %s cannot be fused.\n", proc->name.c_str());
+            is_ok = false;
+            break;
+        }
+        vector<string> proc_params = {":procedure", proc->name,
+                                      src_canvas->name};
+        proc_params.insert(proc_params.end(), step.begin() + 1, step.end());
+        ProcedureArgs args;
+        if (!parse_procedure_args(proc, proc_params, args, CV_MAT_CN(type))) {
+            is_ok = false;
+            break;
+        }
+        args.pool = &pool;
+
+        PointwiseStage *stage = proc->make_stage(args);
+        type = stage->result_type(type);
+        procs.push_back(proc);
+        step_args.push_back(args);
+        stages.push_back(stage);
+    }
+
+    if (is_ok) {
+        Mat src_mat = *(src_canvas->current->mat);
+        Rect roi = Rect(src_canvas->current->roi);
+        Mat src_copy; // (to check that the pipeline leaves its source intact)
+        if (is_compare)
+            src_copy = src_mat.clone();
+        PipelineTraffic traffic;
+        int64 start = getTickCount();
+        Mat result = algo_pipeline(src_mat, roi, stages, &pool, traffic,
+            is_inplace ? src_canvas->take_spare_buffer() : Mat());
+        double ms = (getTickCount() - start) * 1000. / getTickFrequency();
+
+        cout << "  Pipeline:\t\t" << stages.size() << " stages in "
+             << traffic.passes << " passes" << endl;
+        cout << "  Memory traffic:\t" << (traffic.fused_bytes >> 20)
+             << " MiB (as separate procedures: "
+             << (traffic.unfused_bytes >> 20) << " MiB)" << endl;
+        cout << "  Time:\t\t\t" << ms << " ms" << endl;
+
+        if (is_compare) {
+            if (norm(src_copy, src_mat, NORM_INF) != 0)
+                err("Pipeline modified its source canvas.\n");
+            Mat mat = src_copy;
+            start = getTickCount();
+            for (size_t k = 0; k < procs.size(); k++) {
+                Canvas step_canvas("pipeline");
+                step_canvas.current->set_mat(mat);
+                step_canvas.current->roi = k == 0 ? src_canvas->current->roi :
+                                           Rect2d(0, 0, mat.cols, mat.rows);
+                step_canvas.rows = mat.rows;
+                step_canvas.cols = mat.cols;
+                step_canvas.cv_type = mat.type();
+                step_args[k].canvases.front() = &step_canvas;
+                mat = procs[k]->run(step_args[k]);
+            }
+            ms = (getTickCount() - start) * 1000. / getTickFrequency();
+            cout << "  Separately:\t\t" << ms << " ms, max. difference "
+                 << norm(result, mat, NORM_INF) << endl;
+        }
+
+        put_procedure_result(src_canvas, result, is_inplace);
+    }
+
+    for (PointwiseStage *stage : stages)
+        delete stage;
+}
+
+/** Parse the parameters of a procedure: canvases are looked up by name (and
+ *  upgraded to full resolution if previews), and must have a number of
+ *  channels the procedure accepts. (prints the usage or an error on failure)
+ *  The number of channels of the source may be given instead. (pipelines)
+ */
+bool ImgineContext::parse_procedure_args(const Procedure *proc,
+                                         vector<string> params,
+                                         ProcedureArgs &args, int src_channels)
+{
+    size_t required = std::count_if(proc->params.begin(), proc->params.end(),
+        [](const ProcedureParam &param) { return !param.is_optional; });
+    if (params.size() - 2 < required ||
+        params.size() - 2 > proc->params.size()) {
+        warn("? :procedure %s\n", proc->usage().c_str());
+        return false;
+    }
+
+    for (size_t i = 0; i < proc->params.size(); i++) {
+        const ProcedureParam &param = proc->params[i];
+        bool is_given = i + 2 < params.size();
+        if (param.type == PARAM_CANVAS) {
+            Canvas *canvas = get_canvas_by_name(params.at(i + 2));
+            if (!canvas) {
+                err("Canvas not found.\n");
+                return false;
+            }
+            upgrade_preview(canvas); // procedures work at full resolution
+            if (!args.canvases.empty())
+                materialize(canvas); // (the source is up to the procedure)
+            int channels = CV_MAT_CN(canvas->cv_type);
+            if (src_channels && args.canvases.empty())
+                channels = src_channels;
+            if (!proc->channels.empty() &&
+                std::find(proc->channels.begin(), proc->channels.end(),
+                          channels) == proc->channels.end()) {
+                err("Unsupported number of channels: %s\n",
+                    canvas->name.c_str());
+                return false;
+            }
+            args.canvases.push_back(canvas);
+        } else if (param.type == PARAM_COLORSPACE) {
+            Colorspace space = param.default_space;
+            if (is_given)
+                try {
+                    space = COLORSPACE_STRINGS.at(params.at(i + 2));
+                } catch (const std::out_of_range &e) {
+                    err("Unknown colorspace.\n");
+                    return false;
                 }
-            } else {
-                warn("? :procedure color_transfer SRC_CANVAS REF_CANVAS [COLORSPACE]\n");
+            args.spaces.push_back(space);
+        }
+    }
+    if (args.canvases.empty()) {
+        wtf("Procedure %s has no source canvas.\n", proc->name.c_str());
+        return false;
+    }
+    return true;
+}
+
+/** Benchmark:
+ *  Measures the speed and accuracy of an optimized path against the exact
+ *  one, on the image of a canvas (default: all colors of the 8-bit cube).
+ */
+void ImgineContext::execute_benchmark(vector<string> params)
+{
+    if (params.size() > 2 && params.at(1) == "lut") {
+        Colorspace space;
+        try {
+            space = COLORSPACE_STRINGS.at(params.at(2));
+        } catch (const std::out_of_range &e) {
+            err("Unknown colorspace.\n");
+            return;
+        }
+        if (!color_lut_supported(BGR, space)) {
+            err("No LUT for this colorspace.\n");
+            return;
+        }
+
+        Mat src;
+        if (params.size() > 3) {
+            Canvas *target_canvas = get_canvas_by_name(params.at(3));
+            if (!target_canvas) {
+                err("Canvas not found.\n");
+                return;
+            }
+            if (!require_pixels(target_canvas))
+                return;
+            src = *(target_canvas->current->mat);
+            if (src.type() != CV_8UC3) {
+                err("Only 3-channel 8-bit canvases are supported.\n");
                 return;
             }
+        }
 
-        } else {
-            // TODO: more subcommands
-            err("Unknown subcommand.\n");
+        ColorLUTBenchmark result = benchmark_color_lut(src, BGR, space);
+        cout << "  Exact path:\t" << result.exact_ms << " ms" << endl;
+        cout << "  LUT path:\t" << result.lut_ms << " ms" << endl;
+        cout << "  Speedup:\t" << result.exact_ms / result.lut_ms << "x"
+             << endl;
+        cout << "  Max error:\t" << result.max_error << endl;
+        if (result.not_finite)
+            cout << "  Not finite:\t" << result.not_finite << " channels"
+                 << " (exact path only; finite through the LUT)" << endl;
+    } else {
+        warn("? :benchmark lut COLORSPACE [CANVAS]\n");
+    }
+}
+
+/** Undo / Redo:
+ *  Steps the canvas back (or forth) through its history.
+ */
+void ImgineContext::execute_undo(vector<string> params, bool is_redo)
+{
+    if (params.size() > 2) {
+        warn(is_redo ? "? :redo [CANVAS_NAME]\n" : "? :undo [CANVAS_NAME]\n");
+        return;
+    }
+
+    Canvas *target_canvas = active_canvas;
+    if (params.size() == 2) {
+        target_canvas = get_canvas_by_name(params.at(1));
+        if (!target_canvas) {
+            err("Canvas not found: %s\n", params.at(1).c_str());
             return;
         }
+    } else if (!target_canvas) {
+        err("No active canvas.\n");
+        return;
+    }
 
-        // put result into a new canvas
-        new_canvas();
-        *active_canvas->current->mat = result;
-        if (active_canvas->current->mat->data) {
-            int rows = active_canvas->current->mat->rows;
-            int cols = active_canvas->current->mat->cols;
-            int cv_type = active_canvas->current->mat->type();
-            active_canvas->current->roi = Rect2d(0, 0, cols, rows);
-            // TODO: rename canvas
-            active_canvas->rows = rows;
-            active_canvas->cols = cols;
-            active_canvas->cv_type = cv_type;
-            cout << "  Canvas name:\t" << active_canvas->name << endl;
+    if (is_redo ? target_canvas->redo() : target_canvas->undo())
+        cout << "  Current state:\t" << target_canvas->current->id << endl;
+    else
+        err(is_redo ? "Nothing to redo.\n" : "Nothing to undo.\n");
+}
 
-        } else {
-            canvases.remove(active_canvas);
-            delete active_canvas;
-            active_canvas = nullptr;
-            err("Import failed.\n");
+/** History:
+ *  Prints the states of the canvas and the memory taken by its history.
+ */
+void ImgineContext::execute_history(vector<string> params)
+{
+    Canvas *target_canvas = active_canvas;
+    if (params.size() == 2) {
+        target_canvas = get_canvas_by_name(params.at(1));
+        if (!target_canvas) {
+            err("Canvas not found: %s\n", params.at(1).c_str());
+            return;
         }
+    } else if (params.size() > 2) {
+        warn("? :history [CANVAS_NAME]\n");
+        return;
+    } else if (!target_canvas) {
+        err("No active canvas.\n");
+        return;
+    }
+
+    CanvasState *prev = nullptr;
+    for (CanvasState *state : target_canvas->history) {
+        cout << (state == target_canvas->current ? "@ " : "  ") << state->id;
+        if (!state->tiles.empty())
+            cout << "\t" << state->count_shared_tiles(prev) << " / "
+                 << state->tiles.size() << " tiles shared";
+        cout << endl;
+        prev = state;
+    }
+
+    size_t kib = target_canvas->history_bytes() >> 10;
+    size_t mib = kib >> 10;
+    cout << "  History memory:\t"
+         << (mib ? to_string(mib) + " MiB" : to_string(kib) + " KiB")
+         << " (budget " << (config.history_budget >> 20) << " MiB)" << endl;
+}
+
+/** Fill:
+ *  Fills the selected ROI of the active canvas with a value, as a new state.
+ */
+void ImgineContext::execute_fill(vector<string> params)
+{
+    if (params.size() < 2 || params.size() > 5) {
+        warn("? :fill VALUE [VALUE [VALUE [VALUE]]]\n");
+        return;
+    }
+    if (!active_canvas) {
+        err("No active canvas.\n");
+        return;
+    }
+    if (!require_pixels(active_canvas))
+        return;
+
+    Scalar value;
+    try {
+        for (int i = 1; i < params.size(); i++)
+            value.val[i - 1] = boost::lexical_cast<int>(params.at(i));
+    } catch (boost::bad_lexical_cast &) {
+        err("Invalid parameter(s).\n");
+        return;
+    }
+    if (params.size() == 2) // one value: gray
+        value = Scalar::all(value.val[0]);
+
+    CanvasState *state = active_canvas->current;
+    Rect roi = Rect(state->roi) & Rect(0, 0, state->mat->cols,
+                                       state->mat->rows);
+    Mat result = active_canvas->take_spare_buffer();
+    state->mat->copyTo(result);
+    result(roi).setTo(value);
+
+    active_canvas->commit(result, roi);
+    active_canvas->trim_history(config.history_budget);
+    cout << "  Current state:\t" << active_canvas->current->id << endl;
+}
+
+/** Save Workspace:
+ *  Saves all canvases, with their history, into a workspace file.
+ */
+void ImgineContext::execute_save_workspace(vector<string> params)
+{
+    if (params.size() == 2) {
+        string file_name = params.at(1);
+        if (save_workspace(file_name))
+            cout << "  Saved workspace:\t" << file_name << endl;
+        else
+            err("Save failed.\n");
+    } else {
+        warn("? :save_workspace FILE_NAME\n");
+    }
+}
+
+/** Load Workspace:
+ *  Loads the canvases of a workspace file. (mapped, not read)
+ */
+void ImgineContext::execute_load_workspace(vector<string> params)
+{
+    if (params.size() == 2) {
+        string file_name = params.at(1);
+        if (load_workspace(file_name))
+            cout << "  Loaded workspace:\t" << file_name << endl;
+        else
+            err("Load failed.\n");
     } else {
-        warn("? :procedure ALGORITHM [PARAMS]\n");
+        warn("? :load_workspace FILE_NAME\n");
+    }
+}
+
+/** Jobs:
+ *  Lists the background jobs that are still running (or not yet reported).
+ */
+void ImgineContext::execute_jobs(vector<string> params)
+{
+    if (jobs.empty()) {
+        cout << "  No jobs." << endl;
+        return;
+    }
+    for (Job *job : jobs) {
+        stringstream elapsed, progress;
+        elapsed << std::fixed << std::setprecision(1)
+                << (getTickCount() - job->started) / getTickFrequency();
+        int phase = job->progress.phase;
+        long done = job->progress.done, total = job->progress.total;
+        if (total > 0)
+            progress << "phase " << phase << ": " << 100 * done / total
+                     << "% (" << done << "/" << total << " tiles)";
+        else
+            progress << "-";
+        string status = job->is_finished() ? "finished  " :
+                        job->progress.is_cancelled ? "cancelling" :
+                        "running   ";
+        cout << "  [" << job->id << "] " << status << "  " << elapsed.str()
+             << " s\t" << progress.str() << "\t" << job->description << endl;
+    }
+}
+
+/** Wait:
+ *  Waits for a background job (default: all of them) to finish.
+ */
+void ImgineContext::execute_wait(vector<string> params)
+{
+    if (params.size() > 2) {
+        warn("? :wait [JOB_ID]\n");
+        return;
+    }
+
+    int id = -1;
+    if (params.size() == 2) {
+        try {
+            id = boost::lexical_cast<int>(params.at(1));
+        } catch (boost::bad_lexical_cast &) {
+            err("Invalid parameter(s).\n");
+            return;
+        }
+        if (std::none_of(jobs.begin(), jobs.end(),
+                         [id](Job *job) { return job->id == id; })) {
+            err("Job not found: %d\n", id);
+            return;
+        }
+    }
+    wait_jobs(id);
+}
+
+/** Cancel:
+ *  Cancels a background job (default: all of them); it stops at the next
+ *  band or tile, and leaves no result.
+ */
+void ImgineContext::execute_cancel(vector<string> params)
+{
+    if (params.size() > 2) {
+        warn("? :cancel [JOB_ID]\n");
+        return;
+    }
+
+    int id = -1;
+    if (params.size() == 2) {
+        try {
+            id = boost::lexical_cast<int>(params.at(1));
+        } catch (boost::bad_lexical_cast &) {
+            err("Invalid parameter(s).\n");
+            return;
+        }
+        if (std::none_of(jobs.begin(), jobs.end(),
+                         [id](Job *job) { return job->id == id; })) {
+            err("Job not found: %d\n", id);
+            return;
+        }
+    }
+    for (Job *job : jobs) {
+        if ((id < 0 || job->id == id) && !job->is_finished()) {
+            job->progress.is_cancelled = true;
+            cout << "  Cancelling job:\t" << job->id << endl;
+        }
     }
 }
 
@@ -3,13 +3,23 @@
 #define _IMG_CORE_HPP
 
 #include "util_color.hpp"
+#include "util_hist.hpp"
+#include "util_memory.hpp"
+#include "util_thread.hpp"
+#include "util_tile.hpp"
 
 #include <opencv2/opencv.hpp>
 
+#include <map>
+#include <memory>
 #include <thread>
 
 using namespace cv;
 using namespace util_color;
+using namespace util_hist;
+using namespace util_memory;
+using namespace util_thread;
+using namespace util_tile;
 
 using std::list;
 using std::string;
@@ -26,8 +36,14 @@ IMG_CV_TYPES = {
     {CV_8UC4, {4, 8, "uchar"}}
 };
 
+// side length of the blocks history states are stored in (see CanvasState)
+const int HISTORY_TILE = 256;
+
 /** CanvasState maintains the visual state of a canvas, including its image
  *  matrix.
+ *  Only the current state of a canvas keeps a contiguous matrix; the others
+ *  are stored as HISTORY_TILE-sized tiles, and a tile whose content did not
+ *  change is shared with the previous state (copy-on-write).
  */
 class CanvasState {
 
@@ -39,11 +55,46 @@ public:
     string id;
     Mat *mat = nullptr;
     Rect2d roi;
+    Rect dirty; // region that may differ from the previous state
+    vector<Mat> tiles; // history storage (empty while never left)
+    bool is_approximate = false; // preview of a result still being computed
+
+    void set_mat(Mat);
+    void roi_statistics(Rect, Scalar &, Scalar &);
+    Histograms roi_histograms(Rect, ThreadPool *);
+    void release_cache();
+    Mat pyramid_level(int);
+
+    void freeze(CanvasState *);
+    void thaw();
+    void release_mat();
+    int count_shared_tiles(CanvasState *);
+    void set_tiles(Mat);
+    Mat pixels();
+    Size image_size();
+    int image_type();
+
+private:
+    Size tiled_size;
+    int tiled_type = CV_8UC3;
+
+    // per-channel sum and sum-of-squares integral images (built lazily)
+    Mat integral_sum, integral_sqsum;
+    // block-wise integral histograms (built lazily)
+    IntegralHistogram *integral_hist = nullptr;
+    // levels 1.. of the image pyramid, each half the size of the previous
+    // one (built lazily)
+    vector<Mat> pyramid;
 
 };
 
+class LazyImage;
+
 /** Canvas maintains the working session of a canvas, including its historic
  *  states.
+ *  A tiled canvas keeps its image in a TiledImage instead, and a lazy canvas
+ *  the expression it is the result of (until materialized): their current
+ *  state holds only the ROI, and they have no history.
  */
 class Canvas {
 
@@ -56,9 +107,184 @@ public:
     int rows, cols, cv_type;
     CanvasState *current = nullptr;
     list<CanvasState *> history = {};
+    TiledImage *tiled = nullptr; // out-of-core image (if tiled)
+    std::shared_ptr<LazyImage> lazy; // deferred image (if lazy)
+    int preview_scale = 1; // >1: decoded at 1/preview_scale of source_file
+    string source_file;
+    string source_state; // id of the state decoded from source_file
+    int source_flag = -1; // imread() flag of the full-resolution image
+
+    void commit(Mat, Rect);
+    bool undo();
+    bool redo();
+    size_t history_bytes();
+    void trim_history(size_t);
+    Mat take_spare_buffer();
+    void restore_history(list<CanvasState *>, CanvasState *, int);
+    int get_state_counter();
+
+    int64 last_used = 0; // for least-recently-used spilling
+    string spill_path; // raw file of the current matrix (if ever spilled)
+    bool is_spilled = false;
+    size_t resident_bytes();
+    size_t spill();
+    bool reload();
+
+private:
+    int state_counter = 0;
+    Mat spare; // matrix of the last state left, recycled by procedures
+    uchar *mapped_data = nullptr; // current data as mapped from spill_path
+
+    void assign_state_id(CanvasState *);
+    void switch_to_state(CanvasState *);
+
+};
+
+// whole-image passes a procedure makes over its canvases before mapping pixels
+enum ProcedureReduction {
+    REDUCE_NONE = 0,
+    REDUCE_HISTOGRAM = 1, // per-channel histograms of the source
+    REDUCE_MOMENTS = 2 // per-channel mean and stddev of the ROIs
+};
+
+enum ProcedureParamType { PARAM_CANVAS, PARAM_COLORSPACE };
+
+struct ProcedureParam {
+    string name; // as shown in the usage (e.g. SRC_CANVAS)
+    ProcedureParamType type;
+    bool is_optional;
+    Colorspace default_space; // (optional colorspaces)
+};
+
+/** ProcedureArgs holds the parsed arguments of a procedure, in the order of
+ *  its parameters, and how the executor chose to run it.
+ */
+struct ProcedureArgs {
+    vector<Canvas *> canvases; // (the first one is the source)
+    vector<Colorspace> spaces;
+    ThreadPool *pool = nullptr;
+    Mat recycled; // buffer the result may be written into (if in-place safe)
+    string tiled_file; // where a tiled result is written
+    TileCache *tile_cache = nullptr;
+};
+
+/** PointwiseStage is a pointwise procedure bound to its arguments, applied
+ *  one tile at a time, so that consecutive stages can be fused into a single
+ *  pass over cache-sized tiles (see algo_pipeline).
+ *  A stage with reductions is first fed the regions of its input, per slot
+ *  (slots are reduced concurrently, and merged in order).
+ *  Stages never write into their input: reduce() and apply() are handed
+ *  views of shared buffers, such as the source state or memoized regions
+ *  of a lazy image, which are immutable.
+ */
+class PointwiseStage {
+
+public:
+    virtual ~PointwiseStage() {}
+
+    int reductions = REDUCE_NONE;
+    bool reduces_roi = false; // reduces the ROI only (if the first stage)
+
+    virtual int result_type(int) = 0;
+    virtual void begin_reduction(int) {}
+    virtual void reduce(int, const Mat &) {} // (read only)
+    virtual void end_reduction() {}
+    virtual void apply(const Mat &, Mat &) = 0; // (into a matrix of the
+                                                //  result type; thread-safe)
+
+};
+
+/** Procedure describes an image procedure: its parameters, its capabilities
+ *  (from which the executor chooses in-place, tiled or parallel execution),
+ *  and how to run it.
+ *  Procedures are registered at static initialization, by any translation
+ *  unit, with a ProcedureRegistrar.
+ */
+struct Procedure {
+    string name;
+    vector<ProcedureParam> params;
+    bool is_pointwise = false; // output pixel depends on the input pixel only
+                               // (and on the reductions)
+    bool is_inplace_safe = false; // result may go into a recycled buffer
+    int reductions = REDUCE_NONE;
+    vector<int> channels; // accepted numbers of channels of every canvas
+    function<Mat(ProcedureArgs &)> run;
+    function<TiledImage *(ProcedureArgs &)> run_tiled; // (if tileable)
+    function<PointwiseStage *(ProcedureArgs &)> make_stage; // (if fusable)
+
+    bool is_tileable() const;
+    string usage() const;
+    string capabilities() const;
+};
+
+struct ProcedureRegistrar {
+    ProcedureRegistrar(Procedure);
+};
+
+const Procedure *find_procedure(const string &);
+const std::map<string, Procedure> &registered_procedures();
+
+/** LazyImage is the deferred result of a pointwise procedure over an image,
+ *  (a snapshot of a canvas state, or another lazy image) evaluated on demand
+ *  for the regions requested only, and memoized per region.
+ *  Reductions the procedure needs are made once, on first evaluation.
+ */
+class LazyImage {
+
+public:
+    LazyImage(Mat, std::shared_ptr<LazyImage>,
+              std::shared_ptr<PointwiseStage>, Rect);
+
+    Size size;
+    int type;
+
+    Mat evaluate(Rect, ThreadPool *);
+    size_t memo_bytes();
+
+private:
+    Mat source; // (if over a canvas state)
+    std::shared_ptr<LazyImage> input; // (if over another lazy image)
+    std::shared_ptr<PointwiseStage> stage;
+    Rect roi; // of the source, for stages that reduce the ROI
+    bool is_reduced = false;
+    list< std::pair<Rect, Mat> > memo = {}; // most recently used first
+
+    Mat evaluate_input(Rect, ThreadPool *);
+    void reduce(ThreadPool *);
 
 };
 
+// number of regions memoized by each lazy image
+const int LAZY_MEMO_ENTRIES = 8;
+
+/** Job is a command running in the background, (e.g. an export) on its own
+ *  snapshot of the data it needs. Its progress counts the bands or tiles it
+ *  has processed, and cancelling it stops it at the next one.
+ */
+class Job {
+
+public:
+    int id;
+    string description;
+    int64 started = 0; // tick count
+    std::future<void> future;
+    bool is_ok = false; // (valid once finished)
+    string error; // (valid once finished)
+    function<void()> on_finished; // run once, on the main thread
+    Progress progress;
+
+    bool is_finished();
+
+};
+
+// number of threads background jobs run on
+const int JOB_THREADS = 2;
+
+// procedures on larger images are previewed first (see :Pi), on the lowest
+// pyramid level (at most PREVIEW_MAX_LEVEL) of at most PREVIEW_PIXELS pixels
+const int PREVIEW_PIXELS = 1 << 20;
+const int PREVIEW_MAX_LEVEL = 4;
+
 /** ImgineContext is a singleton that maintains all canvases in the workspace.
  */
 class ImgineContext {
@@ -72,6 +298,14 @@ public:
         bool is_console_truecolor = false;
         int console_columns = 80;
         int verbosity = 0;
+        int threads = 1;
+        int frame_rate = 60; // inspect renders at most this many frames/s
+        size_t history_budget = 256 << 20; // bytes of history per canvas
+        bool is_inplace = false; // procedures append to the source canvas
+        bool is_lazy = false; // pointwise procedures are evaluated on demand
+        size_t memory_budget = 0; // bytes of all canvases (0: unlimited)
+        string scratch_dir = "/tmp"; // where canvases are spilled to
+        string workspace_file; // loaded on startup, saved on exit (if set)
     } config;
     struct {
         bool is_gui_on = false;
@@ -79,13 +313,34 @@ public:
         bool is_dragging = false;
         int dragging_start_x = 0;
         int dragging_start_y = 0;
+        bool is_frame_dirty = false; // pointer moved since the last frame
+        bool is_roi_dirty = false; // ROI changed since the last frame
+        int pointer_x = 0;
+        int pointer_y = 0;
+        int64 pending_since = 0; // tick count of the oldest unrendered event
     } state;
     Canvas *active_canvas = nullptr;
     list<Canvas *> canvases = {};
-
+    ThreadPool pool; // shared by all procedures
+    PoolAllocator *allocator = nullptr; // default matrix allocator (if any)
+    TileCache tile_cache{(size_t)512 << 20}; // shared by all tiled canvases
+    list<Job *> jobs = {}; // pending and unreported background jobs
+
+    void set_threads(int);
+    void set_allocator(size_t, bool);
+    void touch(Canvas *);
+    void enforce_memory_budget();
+    bool save_workspace(string);
+    bool load_workspace(string);
     void new_canvas(int, int, int);
     void new_canvas();
+    string next_canvas_id();
     Canvas *get_canvas_by_name(string);
+    string scratch_file_name(string, string);
+    Job *start_job(string, function<void()>);
+    void reap_jobs();
+    bool finish_jobs();
+    void wait_jobs(int);
 
     void debug(const char *, ...);
     void warn(const char *, ...);
@@ -101,14 +356,30 @@ private:
     ImgineContext& operator=(ImgineContext const&) = delete;
 
     int canvas_counter = 0;
+    int64 use_counter = 0;
+    int scratch_counter = 0; // for unique scratch file names
+    int job_counter = 0;
+    ThreadPool job_pool{JOB_THREADS}; // background jobs (e.g. encoding)
     list<thread> threads = {};
+    vector<double> frame_latencies; // event-to-frame latencies (ms)
+    Mat display_buffer; // inspected image with the ROI outline drawn on it
+    Rect display_outline; // outline currently drawn on display_buffer
 
     vector<string> show_properties(Canvas *);
     vector<string> show_statistics(Mat *);
+    vector<string> show_statistics(CanvasState *);
+    vector<string> show_statistics(Canvas *);
+    vector<string> format_statistics(Scalar, Scalar, int);
     vector<string> show_pixel(Mat *, int, int);
     Mat draw_histogram(Mat *);
+    Mat draw_histogram(CanvasState *);
+    Mat draw_histogram(Canvas *);
+    Mat render_histogram(const Histograms &);
 
     static void wait_key_press(ImgineContext *);
+    void run_inspect_loop();
+    void render_inspect_frame();
+    vector<string> show_frame_latency();
     static void on_mouse_event(int, int, int, int, void *);
     static string get_histogram_name(string);
 
@@ -119,7 +390,18 @@ private:
     void execute_delete(vector<string>);
     void execute_rename(vector<string>);
     void execute_import(vector<string>);
+    void execute_import_raw(vector<string>);
+    Mat read_image(string, int, int, bool &);
+    void mark_preview(Canvas *, string, int, int);
+    bool upgrade_preview(Canvas *);
+    bool import_mat(Mat, string);
+    bool import_tiled(string);
+    bool require_pixels(Canvas *);
+    void materialize(Canvas *);
+    Histograms canvas_histograms(Canvas *);
+    Mat roi_pixels(Canvas *);
     void execute_export(vector<string>);
+    bool export_async(string, vector<int>, bool);
 
     void execute_properties(vector<string>);
     void execute_roi(vector<string>);
@@ -129,14 +411,53 @@ private:
     void execute_show(vector<string>);
     void execute_histogram(vector<string>);
     void execute_inspect(vector<string>, bool);
-    void execute_procedure(vector<string>);
+    void execute_procedure(vector<string>, bool);
+    void run_background(const Procedure *, ProcedureArgs &);
+    void run_progressive(const Procedure *, ProcedureArgs &);
+    Canvas *snapshot_canvas(Canvas *);
+    void delete_snapshots(vector<Canvas *>);
+    void swap_full_result(string, Mat);
+    bool parse_procedure_args(const Procedure *, vector<string>,
+                              ProcedureArgs &, int = 0);
+    void put_procedure_result(Canvas *, Mat, bool);
+    void put_lazy_result(Canvas *, PointwiseStage *);
+    void put_tiled_result(TiledImage *);
+    void execute_pipeline(vector<string>);
+    void execute_benchmark(vector<string>);
+    void execute_undo(vector<string>, bool);
+    void execute_history(vector<string>);
+    void execute_fill(vector<string>);
+    void execute_save_workspace(vector<string>);
+    void execute_load_workspace(vector<string>);
+    void execute_jobs(vector<string>);
+    void execute_wait(vector<string>);
+    void execute_cancel(vector<string>);
 
 };
 
 // experimental procedures
-Mat algo_grayscale(Canvas *);
-Mat algo_equalize_hist(Canvas *, Colorspace);
-Mat algo_color_transfer(Canvas *, Canvas *, Colorspace);
+Mat algo_grayscale(Canvas *, ThreadPool * = nullptr, Mat = Mat());
+Mat algo_equalize_hist(Canvas *, Colorspace, ThreadPool * = nullptr,
+                       Mat = Mat());
+Mat algo_color_transfer(Canvas *, Canvas *, Colorspace, ThreadPool * = nullptr,
+                        Mat = Mat());
+TiledImage *algo_grayscale_tiled(Canvas *, const string &, TileCache *,
+                                 ThreadPool * = nullptr);
+TiledImage *algo_equalize_hist_tiled(Canvas *, Colorspace, const string &,
+                                     TileCache *, ThreadPool * = nullptr);
+TiledImage *algo_color_transfer_tiled(Canvas *, Canvas *, Colorspace,
+                                      const string &, TileCache *,
+                                      ThreadPool * = nullptr);
+
+// bytes read and written by a pipeline, fused and as separate procedures
+struct PipelineTraffic {
+    int passes = 0;
+    size_t fused_bytes = 0;
+    size_t unfused_bytes = 0;
+};
+
+Mat algo_pipeline(Mat, Rect, const vector<PointwiseStage *> &, ThreadPool *,
+                  PipelineTraffic &, Mat = Mat());
 
 
 
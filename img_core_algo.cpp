@@ -1,176 +1,859 @@
 
 #include "img_core.hpp"
 #include "util_color.hpp"
+#include "util_thread.hpp"
 
 #include <opencv2/opencv.hpp>
 
 using namespace cv;
 using namespace util_color;
+using namespace util_thread;
 
 using std::cout;
 using std::endl;
+using std::map;
 
 namespace img_core {
 
 /** Convert a BGR color image to grayscale.
  *  (OpenCV uses Rec. 601 luma: y = 0.299 * r + 0.587 * g + 0.114 * b)
+ *  The result is written into the recycled buffer if its size and type match.
  */
-Mat algo_grayscale(Canvas *src_canvas)
+Mat algo_grayscale(Canvas *src_canvas, ThreadPool *pool, Mat recycled)
 {
-    Mat dst_mat = src_canvas->current->mat->clone();
+    Mat src_mat = *(src_canvas->current->mat);
+    Mat dst_mat = recycled;
 
-    if (dst_mat.channels() >= 3)
-        cvtColor(dst_mat, dst_mat, COLOR_BGR2GRAY);
+    if (src_mat.channels() < 3) {
+        src_mat.copyTo(dst_mat);
+        return dst_mat;
+    }
 
+    dst_mat.create(src_mat.rows, src_mat.cols, CV_8UC1);
+    parallel_for_bands(pool, src_mat.rows, [&](int band, int begin, int end) {
+        Mat dst_band = dst_mat.rowRange(begin, end);
+        cvtColor(src_mat.rowRange(begin, end), dst_band, COLOR_BGR2GRAY);
+    });
     return dst_mat;
 }
 
-/** Histogram Equalization.
+/** Create the tiled image a procedure writes its result to. (a temporary
+ *  file, with the tile size of the source)
  */
-Mat algo_equalize_hist(Canvas *src_canvas, Colorspace space)
+static TiledImage *create_result(TiledImage *src, int type,
+                                 const string &file_name, TileCache *cache)
 {
-    Mat dst_mat = src_canvas->current->mat->clone();
+    TiledImage *dst = TiledImage::create(file_name, src->rows, src->cols, type,
+                                         src->tile_size, cache);
+    if (dst)
+        dst->is_temporary = true;
+    return dst;
+}
 
-    if (dst_mat.channels() >= 3) {
-        switch (space) {
-        case HSV:
-            cvtColor(dst_mat, dst_mat, CV_BGR2HSV);
-            break;
-        case HLS:
-            cvtColor(dst_mat, dst_mat, CV_BGR2HLS);
-            break;
-        case YCrCb:
-            cvtColor(dst_mat, dst_mat, CV_BGR2YCrCb);
-            break;
-        default: // default: CIELAB
-            cvtColor(dst_mat, dst_mat, CV_BGR2Lab);
-        }
-    }
+/** Convert a tiled BGR color image to grayscale, tile by tile.
+ */
+TiledImage *algo_grayscale_tiled(Canvas *src_canvas, const string &file_name,
+                                 TileCache *cache, ThreadPool *pool)
+{
+    TiledImage *src = src_canvas->tiled;
+    bool is_color = CV_MAT_CN(src->type) >= 3;
+    int type = is_color ? CV_8UC1 : src->type;
+    std::unique_ptr<TiledImage> dst(create_result(src, type, file_name, cache));
+    if (!dst)
+        return nullptr;
 
-    // split image into single-channel matrices
-    vector<Mat> dst_comp;
-    split(dst_mat, dst_comp);
+    transform_tiles(src, dst.get(), pool,
+                    [&](const Mat &src_tile, Mat &dst_tile) {
+        if (is_color)
+            cvtColor(src_tile, dst_tile, COLOR_BGR2GRAY);
+        else
+            src_tile.copyTo(dst_tile);
+    });
+    return dst.release(); // (deleted, with its file, if a tile failed)
+}
 
-    // equalize the relevant component of histogram
+/** Select the conversions into and out of the working colorspace of
+ *  histogram equalization, and the component to equalize.
+ */
+static void equalization_space(Colorspace space, bool is_color, int &to_code,
+                               int &from_code, int &comp)
+{
     switch (space) {
     case HSV:
-        equalizeHist(dst_comp.back(), dst_comp.back()); // V - Value
+        to_code = CV_BGR2HSV;
+        from_code = CV_HSV2BGR;
+        comp = 2; // V - Value
         break;
     case HLS:
-        equalizeHist(dst_comp[1], dst_comp[1]); // L - Lightness
+        to_code = CV_BGR2HLS;
+        from_code = CV_HLS2BGR;
+        comp = 1; // L - Lightness
+        break;
+    case YCrCb:
+        to_code = CV_BGR2YCrCb;
+        from_code = CV_YCrCb2BGR;
+        comp = 0; // Y - Luma
         break;
-    default: // grayscale, YCrCb or default: CIELAB
-        equalizeHist(dst_comp[0], dst_comp[0]); // L - Lightness
+    default: // default: CIELAB
+        to_code = CV_BGR2Lab;
+        from_code = CV_Lab2BGR;
+        comp = 0; // L - Lightness
     }
+    if (!is_color)
+        comp = 0; // grayscale
+}
 
-    // merge into a multi-channel matrix
-    merge(dst_comp, dst_mat);
+/** Build the equalization mapping of a histogram. (same as equalizeHist())
+ */
+static void equalization_lut(const vector<size_t> &hist, uchar *lut)
+{
+    size_t total = 0;
+    for (size_t n : hist)
+        total += n;
 
-    if (dst_mat.channels() >= 3) {
-        switch (space) {
-        case HSV:
-            cvtColor(dst_mat, dst_mat, CV_HSV2BGR);
-            break;
-        case HLS:
-            cvtColor(dst_mat, dst_mat, CV_HLS2BGR);
-            break;
-        case YCrCb:
-            cvtColor(dst_mat, dst_mat, CV_YCrCb2BGR);
-            break;
-        default: // default: CIELAB
-            cvtColor(dst_mat, dst_mat, CV_Lab2BGR);
+    std::fill(lut, lut + 256, 0);
+    int first = 0;
+    while (first < 255 && !hist[first])
+        first++;
+    if (hist[first] == total) {
+        std::fill(lut, lut + 256, (uchar)first);
+    } else {
+        float scale = 255.f / (total - hist[first]);
+        size_t sum = 0;
+        for (int i = first + 1; i < 256; i++) {
+            sum += hist[i];
+            lut[i] = saturate_cast<uchar>(sum * scale);
         }
     }
+}
+
+/** Map one component of an 8-bit image through a table, in place.
+ */
+static void apply_component_lut(Mat &mat, int comp, const uchar *lut)
+{
+    int cn = mat.channels();
+    for (int i = 0; i < mat.rows; i++) {
+        uchar *p = mat.ptr<uchar>(i) + comp;
+        for (int j = 0; j < mat.cols; j++, p += cn)
+            *p = lut[*p];
+    }
+}
+
+/** Histogram Equalization.
+ *  The image is converted band by band while the histogram of the relevant
+ *  component is gathered per band; the band histograms are summed in order
+ *  into the equalization mapping (same as equalizeHist()), which is then
+ *  applied band by band while converting back. The working colorspace lives
+ *  in the result itself, which is the recycled buffer if its size and type
+ *  match.
+ */
+Mat algo_equalize_hist(Canvas *src_canvas, Colorspace space, ThreadPool *pool,
+                       Mat recycled)
+{
+    Mat src_mat = *(src_canvas->current->mat);
+    bool is_color = src_mat.channels() >= 3;
+
+    int to_code, from_code, comp;
+    equalization_space(space, is_color, to_code, from_code, comp);
+
+    // convert into the working colorspace, histogram per band
+    Mat dst_mat = recycled;
+    dst_mat.create(src_mat.rows, src_mat.cols,
+                   is_color ? CV_8UC3 : src_mat.type());
+    vector< vector<unsigned> > band_hists(band_count(src_mat.rows),
+                                          vector<unsigned>(256, 0));
+    parallel_for_bands(pool, src_mat.rows, [&](int band, int begin, int end) {
+        Mat work_band = dst_mat.rowRange(begin, end);
+        if (is_color)
+            cvtColor(src_mat.rowRange(begin, end), work_band, to_code);
+        else
+            src_mat.rowRange(begin, end).copyTo(work_band);
+
+        add_channel_histogram(band_hists[band], work_band, comp);
+    });
+
+    // equalization mapping
+    vector<size_t> hist(256, 0);
+    for (const auto &h : band_hists) {
+        for (int i = 0; i < 256; i++)
+            hist[i] += h[i];
+    }
+    uchar lut[256];
+    equalization_lut(hist, lut);
+
+    // equalize the relevant component and convert back
+    parallel_for_bands(pool, src_mat.rows, [&](int band, int begin, int end) {
+        Mat work_band = dst_mat.rowRange(begin, end);
+        apply_component_lut(work_band, comp, lut);
+        if (is_color)
+            cvtColor(work_band, work_band, from_code); // in place
+    });
 
     return dst_mat;
 }
 
+/** Histogram Equalization of a tiled image.
+ *  Same as algo_equalize_hist(), in two passes over the tiles: the histogram
+ *  is gathered per tile row (converting each tile into a scratch buffer),
+ *  then every tile is converted, equalized and converted back.
+ */
+TiledImage *algo_equalize_hist_tiled(Canvas *src_canvas, Colorspace space,
+                                     const string &file_name, TileCache *cache,
+                                     ThreadPool *pool)
+{
+    TiledImage *src = src_canvas->tiled;
+    bool is_color = CV_MAT_CN(src->type) >= 3;
+    int to_code, from_code, comp;
+    equalization_space(space, is_color, to_code, from_code, comp);
+
+    // histogram per tile row
+    vector< vector<unsigned> > row_hists(src->grid_rows,
+                                         vector<unsigned>(256, 0));
+    reduce_tiles(src, Rect(0, 0, src->cols, src->rows), pool,
+                 [&](int slot, const Mat &region) {
+        if (is_color) {
+            Mat work;
+            cvtColor(region, work, to_code);
+            add_channel_histogram(row_hists[slot], work, comp);
+        } else {
+            add_channel_histogram(row_hists[slot], region, comp);
+        }
+    });
+
+    vector<size_t> hist(256, 0);
+    for (const auto &h : row_hists) {
+        for (int i = 0; i < 256; i++)
+            hist[i] += h[i];
+    }
+    uchar lut[256];
+    equalization_lut(hist, lut);
+
+    int type = is_color ? CV_8UC3 : src->type;
+    std::unique_ptr<TiledImage> dst(create_result(src, type, file_name, cache));
+    if (!dst)
+        return nullptr;
+    transform_tiles(src, dst.get(), pool,
+                    [&](const Mat &src_tile, Mat &dst_tile) {
+        if (is_color)
+            cvtColor(src_tile, dst_tile, to_code);
+        else
+            src_tile.copyTo(dst_tile);
+        apply_component_lut(dst_tile, comp, lut);
+        if (is_color)
+            cvtColor(dst_tile, dst_tile, from_code); // in place
+    });
+    return dst.release();
+}
+
+/** Size of the float working buffer of tiled procedures.
+ *  (small enough to stay in L2 cache)
+ */
+static const int TILE_BYTES = 256 * 1024;
+static const int TILE_MAX_COLS = 1024;
+
+/** ChannelStats accumulates the mean and variance of each of the 3 channels
+ *  of float pixels. Rows are reduced in cache and merged in (Chan et al.'s
+ *  parallel form of Welford's algorithm), so a region is read only once.
+ */
+struct ChannelStats {
+    double n = 0;
+    double mean[3] = {0, 0, 0};
+    double m2[3] = {0, 0, 0};
+
+    void merge(const ChannelStats &other)
+    {
+        if (other.n == 0)
+            return;
+        double total = n + other.n;
+        for (int c = 0; c < 3; c++) {
+            double delta = other.mean[c] - mean[c];
+            mean[c] += delta * other.n / total;
+            m2[c] += other.m2[c] + delta * delta * n * other.n / total;
+        }
+        n = total;
+    }
+
+    void add_row(const float *p, int cols)
+    {
+        ChannelStats row;
+        row.n = cols;
+        for (int j = 0; j < cols; j++) {
+            for (int c = 0; c < 3; c++)
+                row.mean[c] += p[j * 3 + c];
+        }
+        for (int c = 0; c < 3; c++)
+            row.mean[c] /= cols;
+        for (int j = 0; j < cols; j++) {
+            for (int c = 0; c < 3; c++) {
+                double d = p[j * 3 + c] - row.mean[c];
+                row.m2[c] += d * d;
+            }
+        }
+        merge(row);
+    }
+
+    double stddev(int c) const
+    {
+        return n > 0 ? sqrt(m2[c] / n) : 0;
+    }
+};
+
+/** Compute the statistics of an 8-bit BGR region in a colorspace (scaled to
+ *  [0,1]), converting one row at a time. Bands are reduced in parallel and
+ *  merged in band order, so the result does not depend on the thread count.
+ */
+static ChannelStats swatch_statistics(Mat region, Colorspace space,
+                                      ThreadPool *pool)
+{
+    vector<ChannelStats> band_stats(band_count(region.rows));
+    parallel_for_bands(pool, region.rows, [&](int band, int begin, int end) {
+        Mat buf(1, region.cols, CV_32FC3);
+        for (int i = begin; i < end; i++) {
+            convert_colorspace_8u(region.row(i), buf, BGR, space);
+            band_stats[band].add_row(buf.ptr<float>(0), region.cols);
+        }
+    });
+
+    ChannelStats stats;
+    for (const auto &band : band_stats)
+        stats.merge(band);
+    return stats;
+}
+
+/** Statistics of the swatch (ROI) of a canvas, contiguous or tiled.
+ *  Tiles are reduced per tile row, in order, so the result does not depend on
+ *  the number of threads.
+ */
+static ChannelStats swatch_statistics(Canvas *canvas, Colorspace space,
+                                      ThreadPool *pool)
+{
+    if (!canvas->tiled)
+        return swatch_statistics(
+            Mat(*(canvas->current->mat), canvas->current->roi), space, pool);
+
+    TiledImage *image = canvas->tiled;
+    vector<ChannelStats> slot_stats(image->grid_rows);
+    reduce_tiles(image, canvas->current->roi, pool,
+                 [&](int slot, const Mat &region) {
+        Mat buf(1, region.cols, CV_32FC3);
+        for (int i = 0; i < region.rows; i++) {
+            convert_colorspace_8u(region.row(i), buf, BGR, space);
+            slot_stats[slot].add_row(buf.ptr<float>(0), region.cols);
+        }
+    });
+
+    ChannelStats stats;
+    for (const auto &slot : slot_stats)
+        stats.merge(slot);
+    return stats;
+}
+
+/** Per-channel affine transfer from the source to the reference statistics:
+ *  v' = scale * v + shift
+ */
+struct TransferCoefficients {
+    float scale[3], shift[3];
+
+    TransferCoefficients(const ChannelStats &src_s, const ChannelStats &ref_s)
+    {
+        for (int c = 0; c < 3; c++) {
+            double src_stddev = src_s.stddev(c);
+            scale[c] = src_stddev > 0 ? ref_s.stddev(c) / src_stddev : 1;
+            shift[c] = ref_s.mean[c] - scale[c] * src_s.mean[c];
+        }
+    }
+};
+
+/** Transfer colors of a region, (8-bit -> colorspace -> affine -> BGR -> 8-bit)
+ *  through a float buffer at least as large as the region.
+ */
+static void transfer_region(const Mat &src, Mat dst, Mat &buf, Colorspace space,
+                            const ConversionPlan &back,
+                            const TransferCoefficients &k)
+{
+    Mat tile_buf(buf, Rect(0, 0, src.cols, src.rows));
+
+    convert_colorspace_8u(src, tile_buf, BGR, space);
+    for (int i = 0; i < src.rows; i++) {
+        float *p = tile_buf.ptr<float>(i);
+        for (int j = 0; j < src.cols; j++, p += 3) {
+            for (int c = 0; c < 3; c++)
+                p[c] = k.scale[c] * p[c] + k.shift[c];
+        }
+    }
+    apply_conversion_plan(back, tile_buf, tile_buf);
+
+    // scale up to [0,255]
+    tile_buf.convertTo(dst, CV_8UC3, 255);
+}
+
 /** Color Transfer.
+ *  Swatch statistics are gathered in a single pass, then the source is
+ *  transformed tile by tile (8-bit -> colorspace -> affine -> BGR -> 8-bit)
+ *  in a cache-sized float buffer, so the only full-size allocation is the
+ *  result (none if the recycled buffer matches).
  *  References:
  *    E. Reinhard et al., "Color Transfer between Images". 2001.
  *    E. Reinhard and T. Pouli, "Colour Spaces for Colour Transfer". 2011.
  */
-Mat algo_color_transfer(Canvas *src_canvas, Canvas *ref_canvas, Colorspace space)
+Mat algo_color_transfer(Canvas *src_canvas, Canvas *ref_canvas, Colorspace space,
+                        ThreadPool *pool, Mat recycled)
 {
     // TODO: handle non-CV_8UC3-BGR images
 
-    Mat src_mat = src_canvas->current->mat->clone();
-    Mat src_s(src_mat, src_canvas->current->roi);
-    Mat ref_s(*(ref_canvas->current->mat), ref_canvas->current->roi);
-    Mat dst_mat;
-
-    src_mat.convertTo(src_mat, CV_32FC3);
-    src_s.convertTo(src_s, CV_32FC3);
-    ref_s.convertTo(ref_s, CV_32FC3);
-    // scale down to [0,1]
-    src_mat *= 1. / 255;
-    src_s *= 1. / 255;
-    ref_s *= 1. / 255;
-
-    if (space == RGB) {
-        cvtColor(src_mat, src_mat, CV_BGR2RGB);
-        cvtColor(src_s, src_s, CV_BGR2RGB);
-        cvtColor(ref_s, ref_s, CV_BGR2RGB);
-    } else if (space == HSV) {
-        cvtColor(src_mat, src_mat, CV_BGR2HSV);
-        cvtColor(src_s, src_s, CV_BGR2HSV);
-        cvtColor(ref_s, ref_s, CV_BGR2HSV);
-    } else if (space == CIEXYZ) {
-        cvtColor(src_mat, src_mat, CV_BGR2XYZ);
-        cvtColor(src_s, src_s, CV_BGR2XYZ);
-        cvtColor(ref_s, ref_s, CV_BGR2XYZ);
-    } else if (space == CIELAB) {
-        cvtColor(src_mat, src_mat, CV_BGR2Lab);
-        cvtColor(src_s, src_s, CV_BGR2Lab);
-        cvtColor(ref_s, ref_s, CV_BGR2Lab);
-    } else { // default: Ruderman lαβ
-        cvtColor(src_mat, src_mat, CV_BGR2XYZ);
-        cvtColor(src_s, src_s, CV_BGR2XYZ);
-        cvtColor(ref_s, ref_s, CV_BGR2XYZ);
-        src_mat = convert_colorspace(convert_colorspace(src_mat, CIEXYZ, LMS), LMS, Ruderman_lab);
-        src_s = convert_colorspace(convert_colorspace(src_s, CIEXYZ, LMS), LMS, Ruderman_lab);
-        ref_s = convert_colorspace(convert_colorspace(ref_s, CIEXYZ, LMS), LMS, Ruderman_lab);
-    }
+    Mat src_mat = *(src_canvas->current->mat);
+    Mat dst_mat = recycled;
+    dst_mat.create(src_mat.rows, src_mat.cols, CV_8UC3);
 
     // compute partial statistics of swatches (ROIs)
-    vector<double> src_s_mean, ref_s_mean, src_s_stddev, ref_s_stddev;
-    meanStdDev(src_s, src_s_mean, src_s_stddev);
-    meanStdDev(ref_s, ref_s_mean, ref_s_stddev);
+    TransferCoefficients k(swatch_statistics(src_canvas, space, pool),
+                           swatch_statistics(ref_canvas, space, pool));
+
+    // each band is a row of tiles, with its own tile buffer
+    const ConversionPlan &back = get_conversion_plan(space, BGR);
+    int tile_cols = min(src_mat.cols, TILE_MAX_COLS);
+    int tile_rows = max(1, TILE_BYTES / (tile_cols * 3 * (int)sizeof(float)));
+
+    parallel_for_bands(pool, src_mat.rows, [&](int band, int begin, int end) {
+        Mat buf(tile_rows, tile_cols, CV_32FC3);
+        for (int x = 0; x < src_mat.cols; x += tile_cols) {
+            Rect tile(x, begin, min(tile_cols, src_mat.cols - x), end - begin);
+            transfer_region(src_mat(tile), dst_mat(tile), buf, space, back, k);
+        }
+    }, tile_rows);
+
+    return dst_mat;
+}
+
+/** Color Transfer of a tiled image. (the reference may be tiled or not)
+ *  Each image tile is transformed through the same cache-sized buffer as
+ *  algo_color_transfer(), in strips of its rows.
+ */
+TiledImage *algo_color_transfer_tiled(Canvas *src_canvas, Canvas *ref_canvas,
+                                      Colorspace space, const string &file_name,
+                                      TileCache *cache, ThreadPool *pool)
+{
+    TiledImage *src = src_canvas->tiled;
+    TransferCoefficients k(swatch_statistics(src_canvas, space, pool),
+                           swatch_statistics(ref_canvas, space, pool));
+
+    std::unique_ptr<TiledImage> dst(create_result(src, CV_8UC3, file_name,
+                                                  cache));
+    if (!dst)
+        return nullptr;
+
+    const ConversionPlan &back = get_conversion_plan(space, BGR);
+    int tile_cols = src->tile_size;
+    int tile_rows = max(1, TILE_BYTES / (tile_cols * 3 * (int)sizeof(float)));
+    transform_tiles(src, dst.get(), pool,
+                    [&](const Mat &src_tile, Mat &dst_tile) {
+        Mat buf(tile_rows, tile_cols, CV_32FC3);
+        for (int y = 0; y < src_tile.rows; y += tile_rows) {
+            Rect strip(0, y, src_tile.cols, min(tile_rows, src_tile.rows - y));
+            transfer_region(src_tile(strip), dst_tile(strip), buf, space,
+                            back, k);
+        }
+    });
+    return dst.release();
+}
+
+
+/** Grayscale, as a pipeline stage.
+ */
+class GrayscaleStage : public PointwiseStage {
+
+public:
+    int result_type(int type)
+    {
+        return CV_MAT_CN(type) >= 3 ? CV_8UC1 : type;
+    }
+
+    void apply(const Mat &src, Mat &dst)
+    {
+        if (src.channels() >= 3)
+            cvtColor(src, dst, COLOR_BGR2GRAY);
+        else
+            src.copyTo(dst);
+    }
+
+};
 
-    // split images into single-channel matrices
-    vector<Mat> src_comp, dst_comp;
-    split(src_mat, src_comp);
-    split(src_mat, dst_comp);
+/** Histogram equalization, as a pipeline stage. (the histogram of the whole
+ *  input is reduced first)
+ */
+class EqualizeHistStage : public PointwiseStage {
 
-    // color transfer per channel
-    for (int i = 0; i < 3; i++) {
-        dst_comp[i] = (ref_s_stddev[i] / src_s_stddev[i])
-            * (src_comp[i] - src_s_mean[i]) + ref_s_mean[i];
+public:
+    EqualizeHistStage(Colorspace space) : space(space)
+    {
+        reductions = REDUCE_HISTOGRAM;
     }
 
-    // merge into a multi-channel matrix
-    merge(dst_comp, dst_mat);
+    int result_type(int type)
+    {
+        return CV_MAT_CN(type) >= 3 ? CV_8UC3 : type;
+    }
 
-    if (space == RGB) {
-        cvtColor(dst_mat, dst_mat, CV_RGB2BGR);
-    } else if (space == HSV) {
-        cvtColor(dst_mat, dst_mat, CV_HSV2BGR);
-    } else if (space == CIEXYZ) {
-        cvtColor(dst_mat, dst_mat, CV_XYZ2BGR);
-    } else if (space == CIELAB) {
-        cvtColor(dst_mat, dst_mat, CV_Lab2BGR);
-    } else { // default: Ruderman lαβ
-        dst_mat = convert_colorspace(convert_colorspace(dst_mat, Ruderman_lab, LMS), LMS, CIEXYZ);
-        cvtColor(dst_mat, dst_mat, CV_XYZ2BGR);
+    void begin_reduction(int slots)
+    {
+        slot_hists.assign(slots, vector<size_t>(256, 0));
+        slot_works.assign(slots, Mat());
     }
 
-    // scale up to [0,255]
-    dst_mat *= 255;
-    dst_mat.convertTo(dst_mat, CV_8UC3);
+    void reduce(int slot, const Mat &region)
+    {
+        int to_code, from_code, comp;
+        equalization_space(space, region.channels() >= 3, to_code, from_code,
+                           comp);
+        Mat work = region; // (read only: may be a view of the source)
+        if (region.channels() >= 3) {
+            Mat &converted = slot_works[slot];
+            cvtColor(region, converted, to_code);
+            work = converted;
+        }
+        int cn = work.channels();
+        vector<size_t> &hist = slot_hists[slot];
+        for (int i = 0; i < work.rows; i++) {
+            const uchar *p = work.ptr<uchar>(i) + comp;
+            for (int j = 0; j < work.cols; j++, p += cn)
+                hist[*p]++;
+        }
+    }
+
+    void end_reduction()
+    {
+        vector<size_t> hist(256, 0);
+        for (const auto &h : slot_hists)
+            for (int i = 0; i < 256; i++)
+                hist[i] += h[i];
+        equalization_lut(hist, lut);
+        slot_works.clear();
+    }
+
+    void apply(const Mat &src, Mat &dst)
+    {
+        bool is_color = src.channels() >= 3;
+        int to_code, from_code, comp;
+        equalization_space(space, is_color, to_code, from_code, comp);
+        if (is_color)
+            cvtColor(src, dst, to_code);
+        else
+            src.copyTo(dst);
+        apply_component_lut(dst, comp, lut);
+        if (is_color)
+            cvtColor(dst, dst, from_code); // in place
+    }
+
+private:
+    Colorspace space;
+    vector< vector<size_t> > slot_hists;
+    vector<Mat> slot_works; // converted regions, per slot
+    uchar lut[256];
+
+};
+
+/** Color transfer, as a pipeline stage. (the statistics of the swatch of the
+ *  input are reduced first; those of the reference are known)
+ */
+class ColorTransferStage : public PointwiseStage {
+
+public:
+    ColorTransferStage(Canvas *ref_canvas, Colorspace space, ThreadPool *pool)
+        : space(space), back(get_conversion_plan(space, BGR)),
+          ref_stats(swatch_statistics(ref_canvas, space, pool)),
+          k(ChannelStats(), ChannelStats())
+    {
+        reductions = REDUCE_MOMENTS;
+        reduces_roi = true;
+    }
+
+    int result_type(int type)
+    {
+        return CV_8UC3;
+    }
+
+    void begin_reduction(int slots)
+    {
+        slot_stats.assign(slots, ChannelStats());
+    }
+
+    void reduce(int slot, const Mat &region)
+    {
+        Mat buf(1, region.cols, CV_32FC3);
+        for (int i = 0; i < region.rows; i++) {
+            convert_colorspace_8u(region.row(i), buf, BGR, space);
+            slot_stats[slot].add_row(buf.ptr<float>(0), region.cols);
+        }
+    }
+
+    void end_reduction()
+    {
+        ChannelStats src_stats;
+        for (const auto &slot : slot_stats)
+            src_stats.merge(slot);
+        k = TransferCoefficients(src_stats, ref_stats);
+    }
+
+    void apply(const Mat &src, Mat &dst)
+    {
+        // in cache-sized strips, through a float buffer kept per thread
+        static thread_local Mat buf;
+        int tile_cols = min(src.cols, TILE_MAX_COLS);
+        int tile_rows = max(1, TILE_BYTES /
+                               (tile_cols * 3 * (int)sizeof(float)));
+        if (buf.rows < tile_rows || buf.cols < tile_cols)
+            buf.create(max(buf.rows, tile_rows), max(buf.cols, tile_cols),
+                       CV_32FC3);
+        for (int y = 0; y < src.rows; y += tile_rows) {
+            for (int x = 0; x < src.cols; x += tile_cols) {
+                Rect strip(x, y, min(tile_cols, src.cols - x),
+                           min(tile_rows, src.rows - y));
+                transfer_region(src(strip), dst(strip), buf, space, back, k);
+            }
+        }
+    }
+
+private:
+    Colorspace space;
+    const ConversionPlan &back;
+    ChannelStats ref_stats;
+    vector<ChannelStats> slot_stats;
+    TransferCoefficients k;
+
+};
+
+/** Stream an area of the image through the first stages, one cache-sized
+ *  tile at a time (per thread, through one buffer per stage), and pass each
+ *  tile of the output of the last of them to the sink, with its band.
+ */
+static void stream_stages(const Mat &src, Rect area,
+                          const vector<PointwiseStage *> &stages, int count,
+                          const vector<int> &types, ThreadPool *pool,
+                          function<void(int, Rect, const Mat &)> sink)
+{
+    int tile_cols = min(area.width, TILE_MAX_COLS);
+    int tile_rows = max(1, TILE_BYTES / (tile_cols * 3 * (int)sizeof(float)));
+
+    parallel_for_bands(pool, area.height, [&](int band, int begin, int end) {
+        vector<Mat> bufs(count);
+        for (int k = 0; k < count; k++)
+            bufs[k].create(tile_rows, tile_cols, types[k + 1]);
+
+        for (int x = area.x; x < area.x + area.width; x += tile_cols) {
+            Rect tile(x, area.y + begin,
+                      min(tile_cols, area.x + area.width - x), end - begin);
+            Mat cur = src(tile);
+            for (int k = 0; k < count; k++) {
+                Mat next = bufs[k](Rect(0, 0, tile.width, tile.height));
+                stages[k]->apply(cur, next);
+                cur = next;
+            }
+            sink(band, tile, cur);
+        }
+    }, tile_rows);
+}
+
+/** Run a chain of pointwise stages over an image, fused: intermediate
+ *  results only ever exist as cache-sized tiles. A stage that needs a
+ *  reduction of its input gets a pass of its own, which recomputes the
+ *  stages before it tile by tile rather than storing them; then one final
+ *  pass runs all stages into the result. (written into the recycled buffer
+ *  if its size and type match)
+ *  The reductions are those of the separate procedures: the first stage
+ *  reduces the ROI, the others their whole input (a procedure result has a
+ *  full ROI), so the result is that of running them one by one.
+ */
+Mat algo_pipeline(Mat src_mat, Rect roi, const vector<PointwiseStage *> &stages,
+                  ThreadPool *pool, PipelineTraffic &traffic, Mat recycled)
+{
+    int n = stages.size();
+    vector<int> types = {src_mat.type()};
+    for (PointwiseStage *stage : stages)
+        types.push_back(stage->result_type(types.back()));
+
+    Rect full(0, 0, src_mat.cols, src_mat.rows);
+    auto area_bytes = [](Rect area, int type) {
+        return (size_t)area.area() * CV_ELEM_SIZE(type);
+    };
+    traffic = PipelineTraffic();
+
+    // reduction passes
+    for (int r = 0; r < n; r++) {
+        PointwiseStage *stage = stages[r];
+        if (stage->reductions == REDUCE_NONE)
+            continue;
+        Rect area = r == 0 && stage->reduces_roi ? roi & full : full;
+        if (area.area() == 0)
+            area = full;
 
+        int tile_cols = min(area.width, TILE_MAX_COLS);
+        int tile_rows = max(1, TILE_BYTES /
+                               (tile_cols * 3 * (int)sizeof(float)));
+        stage->begin_reduction(band_count(area.height, tile_rows));
+        stream_stages(src_mat, area, stages, r, types, pool,
+                      [&](int band, Rect tile, const Mat &input) {
+            stage->reduce(band, input);
+        });
+        stage->end_reduction();
+
+        traffic.passes++;
+        traffic.fused_bytes += area_bytes(area, types[0]);
+        traffic.unfused_bytes += area_bytes(area, types[r]);
+    }
+
+    // final pass, the last stage writing into the result
+    Mat dst_mat = recycled;
+    dst_mat.create(src_mat.rows, src_mat.cols, types[n]);
+    stream_stages(src_mat, full, stages, n - 1, types, pool,
+                  [&](int band, Rect tile, const Mat &input) {
+        Mat dst_tile = dst_mat(tile);
+        stages[n - 1]->apply(input, dst_tile);
+    });
+
+    traffic.passes++;
+    traffic.fused_bytes += area_bytes(full, types[0]) +
+                           area_bytes(full, types[n]);
+    for (int k = 0; k < n; k++) // each procedure reads and writes an image
+        traffic.unfused_bytes += area_bytes(full, types[k]) +
+                                 area_bytes(full, types[k + 1]);
     return dst_mat;
 }
 
+/** Return the registry of procedures. (constructed on first use, so that
+ *  registrars in any translation unit may run first)
+ */
+static map<string, Procedure> &procedure_registry()
+{
+    static map<string, Procedure> registry;
+    return registry;
+}
+
+/** Register a procedure. (a later registration of the same name wins)
+ */
+ProcedureRegistrar::ProcedureRegistrar(Procedure proc)
+{
+    procedure_registry()[proc.name] = proc;
+}
+
+/** Return the procedure of the name, or nullptr.
+ */
+const Procedure *find_procedure(const string &name)
+{
+    auto it = procedure_registry().find(name);
+    return it == procedure_registry().end() ? nullptr : &it->second;
+}
+
+/** Return all registered procedures, by name.
+ */
+const map<string, Procedure> &registered_procedures()
+{
+    return procedure_registry();
+}
+
+bool Procedure::is_tileable() const
+{
+    return (bool)run_tiled;
+}
+
+/** Return the parameters of the procedure, as in ":procedure NAME ...".
+ */
+string Procedure::usage() const
+{
+    string ret = name;
+    for (const auto &param : params)
+        ret += param.is_optional ? " [" + param.name + "]" : " " + param.name;
+    return ret;
+}
+
+/** Return a short description of the capabilities of the procedure.
+ */
+string Procedure::capabilities() const
+{
+    string ret = is_pointwise ? "pointwise" : "neighborhood";
+    if (is_inplace_safe)
+        ret += ", in-place";
+    if (is_tileable())
+        ret += ", tileable";
+    if (reductions & REDUCE_HISTOGRAM)
+        ret += ", histogram";
+    if (reductions & REDUCE_MOMENTS)
+        ret += ", moments";
+    if (!channels.empty()) {
+        ret += ", channels";
+        for (size_t i = 0; i < channels.size(); i++)
+            ret += (i ? "/" : " ") + std::to_string(channels[i]);
+    }
+    return ret;
+}
+
+static ProcedureRegistrar grayscale_registrar([]() {
+    Procedure proc;
+    proc.name = "grayscale";
+    proc.params = {{"SRC_CANVAS", PARAM_CANVAS, false, BGR}};
+    proc.is_pointwise = true;
+    proc.is_inplace_safe = true;
+    proc.channels = {1, 3, 4};
+    proc.run = [](ProcedureArgs &args) {
+        return algo_grayscale(args.canvases[0], args.pool, args.recycled);
+    };
+    proc.run_tiled = [](ProcedureArgs &args) {
+        return algo_grayscale_tiled(args.canvases[0], args.tiled_file,
+                                    args.tile_cache, args.pool);
+    };
+    proc.make_stage = [](ProcedureArgs &args) -> PointwiseStage * {
+        return new GrayscaleStage();
+    };
+    return proc;
+}());
+
+static ProcedureRegistrar equalize_hist_registrar([]() {
+    Procedure proc;
+    proc.name = "equalize_hist";
+    proc.params = {{"SRC_CANVAS", PARAM_CANVAS, false, BGR},
+                   {"COLORSPACE", PARAM_COLORSPACE, true, CIELAB}};
+    proc.is_pointwise = true;
+    proc.is_inplace_safe = true;
+    proc.reductions = REDUCE_HISTOGRAM;
+    proc.channels = {1, 3, 4};
+    proc.run = [](ProcedureArgs &args) {
+        return algo_equalize_hist(args.canvases[0], args.spaces[0], args.pool,
+                                  args.recycled);
+    };
+    proc.run_tiled = [](ProcedureArgs &args) {
+        return algo_equalize_hist_tiled(args.canvases[0], args.spaces[0],
+                                        args.tiled_file, args.tile_cache,
+                                        args.pool);
+    };
+    proc.make_stage = [](ProcedureArgs &args) -> PointwiseStage * {
+        return new EqualizeHistStage(args.spaces[0]);
+    };
+    return proc;
+}());
 
+static ProcedureRegistrar color_transfer_registrar([]() {
+    Procedure proc;
+    proc.name = "color_transfer";
+    proc.params = {{"SRC_CANVAS", PARAM_CANVAS, false, BGR},
+                   {"REF_CANVAS", PARAM_CANVAS, false, BGR},
+                   {"COLORSPACE", PARAM_COLORSPACE, true, Ruderman_lab}};
+    proc.is_pointwise = true;
+    proc.is_inplace_safe = true;
+    proc.reductions = REDUCE_MOMENTS;
+    proc.channels = {3}; // TODO: handle non-CV_8UC3-BGR images
+    proc.run = [](ProcedureArgs &args) {
+        return algo_color_transfer(args.canvases[0], args.canvases[1],
+                                   args.spaces[0], args.pool, args.recycled);
+    };
+    proc.run_tiled = [](ProcedureArgs &args) {
+        return algo_color_transfer_tiled(args.canvases[0], args.canvases[1],
+                                         args.spaces[0], args.tiled_file,
+                                         args.tile_cache, args.pool);
+    };
+    proc.make_stage = [](ProcedureArgs &args) -> PointwiseStage * {
+        return new ColorTransferStage(args.canvases[1], args.spaces[0],
+                                      args.pool);
+    };
+    return proc;
+}());
 
 } // namespace img_core
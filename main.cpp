@@ -12,6 +12,11 @@ extern "C" {
 #include <histedit.h>
 }
 
+#include <algorithm>
+#include <cstdlib>
+
+#include <unistd.h>
+
 using namespace img_core;
 
 using boost::escaped_list_separator;
@@ -54,6 +59,30 @@ int main(int argc, char *argv[])
          "specify verbosity level")
         ("debug,d",
          "enable debugging (same as --verbose=1)")
+        ("threads,j", po::value<int>()->default_value(0),
+         "specify number of threads for procedures (0: all hardware threads)")
+        ("history-budget", po::value<int>()->default_value(256),
+         "specify memory budget for the history of each canvas (MiB)")
+        ("inplace",
+         "append procedure results to the history of the source canvas")
+        ("lazy",
+         "record pointwise procedure results, evaluated on demand per region")
+        ("pool-cache", po::value<int>()->default_value(0),
+         "enable a buffer pool keeping up to this much freed memory for "
+         "reuse (MiB, 0: no pool)")
+        ("huge-pages",
+         "back large pooled buffers with transparent huge pages "
+         "(with --pool-cache)")
+        ("memory-budget", po::value<int>()->default_value(0),
+         "specify memory budget for all canvases before inactive ones are "
+         "spilled to disk (MiB, 0: unlimited)")
+        ("tile-cache", po::value<int>()->default_value(512),
+         "specify memory for tiles of tiled (.imgt) canvases (MiB)")
+        ("workspace,w", po::value<string>(),
+         "specify workspace file loaded on startup and saved on exit")
+        ("scratch-dir", po::value<string>(),
+         "specify directory for spilled canvases and tiled results "
+         "(default: $TMPDIR or /tmp)")
         //("optimization", po::value<int>()->default_value(10),
         //"optimization level")
         ("execute,e",
@@ -152,10 +181,35 @@ int main(int argc, char *argv[])
     }
     if (imgine.config.verbosity)
         imgine.debug("Debugging enabled.\n");
+    imgine.set_threads(vm["threads"].as<int>());
+    imgine.set_allocator((size_t)std::max(0, vm["pool-cache"].as<int>()) << 20,
+                         vm.count("huge-pages"));
+    imgine.config.is_inplace = vm.count("inplace");
+    imgine.config.is_lazy = vm.count("lazy");
+    imgine.config.history_budget =
+        (size_t)std::max(0, vm["history-budget"].as<int>()) << 20;
+    imgine.config.memory_budget =
+        (size_t)std::max(0, vm["memory-budget"].as<int>()) << 20;
+    imgine.tile_cache.max_bytes =
+        (size_t)std::max(1, vm["tile-cache"].as<int>()) << 20;
+    if (vm.count("scratch-dir"))
+        imgine.config.scratch_dir = vm["scratch-dir"].as<string>();
+    else if (getenv("TMPDIR"))
+        imgine.config.scratch_dir = getenv("TMPDIR");
+
+    // Restore the workspace, if any.
+    if (vm.count("workspace")) {
+        imgine.config.workspace_file = vm["workspace"].as<string>();
+        if (access(imgine.config.workspace_file.c_str(), F_OK) == 0)
+            imgine.execute({":load_workspace", imgine.config.workspace_file});
+    }
 
-    // Process --input-file imports.
-    for (string &input_file : input_files) {
-        imgine.execute({":import", input_file});
+    // Process --input-file imports. (decoded concurrently)
+    if (!input_files.empty()) {
+        vector<string> import_params = {":import"};
+        import_params.insert(import_params.end(), input_files.begin(),
+                             input_files.end());
+        imgine.execute(import_params);
     }
 
     // Initialize EditLine.
@@ -1,14 +1,21 @@
 
 #include "util_color.hpp"
+#include "util_thread.hpp"
 
 #include <opencv2/opencv.hpp>
 
+#include <cmath>
+#include <deque>
+#include <functional>
 #include <iomanip>
+#include <mutex>
 #include <sstream>
 
 using namespace cv;
 
 using std::to_string;
+using std::vector;
+using util_thread::parallel_for_bands;
 
 namespace util_color {
 
@@ -38,105 +45,469 @@ string alpha_to_opacity_percentage(unsigned char a)
     return to_string(int(a / 255. * 100)) + "%";
 }
 
-/** Convert a 3-channel matrix from BGR space to CIE XYZ space.
+/** Linear transformation from RGB to CIE XYZ (D65 white point).
+ *  (the same coefficients OpenCV uses for CV_BGR2XYZ)
  *  Reference:
  *    <http://docs.opencv.org/3.0-beta/modules/imgproc/doc/miscellaneous_transformations.html>
  */
-Mat convert_BGR_to_CIEXYZ(Mat src, bool forwardDirection = true)
+static const Matx33f RGB_TO_CIEXYZ(
+    0.412453f, 0.357580f, 0.180423f,
+    0.212671f, 0.715160f, 0.072169f,
+    0.019334f, 0.119193f, 0.950227f);
+
+/** Linear transformation from CIE XYZ to LMS. (von Kries transformation)
+ *  Reference:
+ *    <https://en.wikipedia.org/wiki/LMS_color_space>
+ */
+static const Matx33f CIEXYZ_TO_LMS(
+    0.38971f, 0.68898f, -0.07868f,
+    -0.22981f, 1.18340f, 0.04641f,
+    0.00000f, 0.00000f, 1.00000f);
+
+/** Linear transformation from log-LMS to Ruderman's lαβ.
+ *  (diag(1/sqrt(3), 1/sqrt(6), 1/sqrt(2)) * [1 1 1; 1 1 -2; 1 -1 0])
+ *  Reference:
+ *    E. Reinhard and T. Pouli, "Colour Spaces for Colour Transfer". 2011.
+ */
+static const Matx33f LOG_LMS_TO_RUDERMAN_LAB(
+    0.57735027f, 0.57735027f, 0.57735027f,
+    0.40824829f, 0.40824829f, -0.81649658f,
+    0.70710678f, -0.70710678f, 0.f);
+
+/** Swap the first and the last channel. (BGR <-> RGB)
+ */
+static const Matx33f SWAP_RB(
+    0.f, 0.f, 1.f,
+    0.f, 1.f, 0.f,
+    1.f, 0.f, 0.f);
+
+/** Forward and inverse matrices of each linear step, computed once.
+ */
+static const Matx33f &bgr_to_ciexyz(bool forward)
 {
-    Mat trans_mat = (Mat_<float>(3,3) <<
-                     0.412453, 0.357580, 0.180423,
-                     0.212671, 0.715160, 0.072169,
-                     0.019334, 0.119193, 0.950227);
-    Mat dst = src.clone();
-    for (int i = 0; i < src.rows; i++) {
-        for (int j = 0; j < src.cols; j++) {
-            Vec3f& s = src.at<Vec3f>(i, j);
-            Mat t = (forwardDirection ? trans_mat : trans_mat.inv()) *
-                (Mat_<float>(3,1) << s.val[2], s.val[1], s.val[0]); // BGR to RGB
-            dst.at<Vec3f>(i, j).val[0] = t.at<float>(0, 0);
-            dst.at<Vec3f>(i, j).val[1] = t.at<float>(1, 0);
-            dst.at<Vec3f>(i, j).val[2] = t.at<float>(2, 0);
+    static const Matx33f fwd = RGB_TO_CIEXYZ * SWAP_RB;
+    static const Matx33f inv = fwd.inv();
+    return forward ? fwd : inv;
+}
+
+static const Matx33f &ciexyz_to_lms(bool forward)
+{
+    static const Matx33f inv = CIEXYZ_TO_LMS.inv();
+    return forward ? CIEXYZ_TO_LMS : inv;
+}
+
+static const Matx33f &log_lms_to_ruderman_lab(bool forward)
+{
+    static const Matx33f inv = LOG_LMS_TO_RUDERMAN_LAB.inv();
+    return forward ? LOG_LMS_TO_RUDERMAN_LAB : inv;
+}
+
+static ConversionStep linear_step(const Matx33f &m)
+{
+    return {ConversionStep::LINEAR, m, 0};
+}
+
+static ConversionStep cvt_step(int code)
+{
+    return {ConversionStep::CVT, Matx33f(), code};
+}
+
+static ConversionStep log_step()
+{
+    return {ConversionStep::LOG, Matx33f(), 0};
+}
+
+static ConversionStep exp_step()
+{
+    return {ConversionStep::EXP, Matx33f(), 0};
+}
+
+/** An edge of the conversion graph: a direct conversion between two spaces.
+ */
+struct ConversionEdge {
+    Colorspace from, to;
+    ConversionPlan steps;
+};
+
+/** Return all edges of the conversion graph. Every colorspace is reachable
+ *  from every other one (BGR is the hub, XYZ -> LMS -> lαβ is a chain).
+ */
+static vector<ConversionEdge> conversion_edges()
+{
+    return {
+        {BGR, RGB, {linear_step(SWAP_RB)}},
+        {RGB, BGR, {linear_step(SWAP_RB)}},
+        {BGR, HSV, {cvt_step(CV_BGR2HSV)}},
+        {HSV, BGR, {cvt_step(CV_HSV2BGR)}},
+        {BGR, HLS, {cvt_step(CV_BGR2HLS)}},
+        {HLS, BGR, {cvt_step(CV_HLS2BGR)}},
+        {BGR, YCrCb, {cvt_step(CV_BGR2YCrCb)}},
+        {YCrCb, BGR, {cvt_step(CV_YCrCb2BGR)}},
+        {BGR, CIEXYZ, {linear_step(bgr_to_ciexyz(true))}},
+        {CIEXYZ, BGR, {linear_step(bgr_to_ciexyz(false))}},
+        {BGR, CIELAB, {cvt_step(CV_BGR2Lab)}},
+        {CIELAB, BGR, {cvt_step(CV_Lab2BGR)}},
+        {CIEXYZ, LMS, {linear_step(ciexyz_to_lms(true))}},
+        {LMS, CIEXYZ, {linear_step(ciexyz_to_lms(false))}},
+        {LMS, Ruderman_lab,
+         {log_step(), linear_step(log_lms_to_ruderman_lab(true))}},
+        {Ruderman_lab, LMS,
+         {linear_step(log_lms_to_ruderman_lab(false)), exp_step()}}
+    };
+}
+
+/** Find the shortest path (in number of edges) between two colorspaces and
+ *  concatenate its steps, folding adjacent linear steps into one matrix.
+ */
+static ConversionPlan build_conversion_plan(const vector<ConversionEdge> &edges,
+                                            Colorspace src_space,
+                                            Colorspace dst_space)
+{
+    // breadth-first search from src_space
+    vector<int> via(NUM_COLORSPACES, -1); // index of the edge reaching a node
+    vector<bool> visited(NUM_COLORSPACES, false);
+    std::deque<Colorspace> queue = {src_space};
+    visited[src_space] = true;
+    while (!queue.empty() && !visited[dst_space]) {
+        Colorspace node = queue.front();
+        queue.pop_front();
+        for (int i = 0; i < edges.size(); i++) {
+            if (edges[i].from == node && !visited[edges[i].to]) {
+                visited[edges[i].to] = true;
+                via[edges[i].to] = i;
+                queue.push_back(edges[i].to);
+            }
         }
     }
-    return dst;
+    CV_Assert(visited[dst_space]);
+
+    vector<int> path;
+    for (Colorspace node = dst_space; node != src_space;
+         node = edges[via[node]].from) {
+        path.insert(path.begin(), via[node]);
+    }
+
+    ConversionPlan plan;
+    for (int i : path) {
+        for (const auto &step : edges[i].steps) {
+            if (step.kind == ConversionStep::LINEAR && !plan.empty() &&
+                plan.back().kind == ConversionStep::LINEAR) {
+                plan.back().m = step.m * plan.back().m;
+            } else {
+                plan.push_back(step);
+            }
+        }
+    }
+    return plan;
 }
 
-/** Convert a 3-channel matrix from CIE XYZ space to LMS space.
- *  (von Kries transformation)
- *  Reference:
- *    <https://en.wikipedia.org/wiki/LMS_color_space>
+/** Return the conversion plan between two colorspaces.
+ *  All plans are built on first use and cached.
+ */
+const ConversionPlan &get_conversion_plan(Colorspace src_space,
+                                          Colorspace dst_space)
+{
+    static const vector<ConversionPlan> plans = [] {
+        vector<ConversionEdge> edges = conversion_edges();
+        vector<ConversionPlan> ret;
+        for (int i = 0; i < NUM_COLORSPACES; i++) {
+            for (int j = 0; j < NUM_COLORSPACES; j++) {
+                ret.push_back(build_conversion_plan(edges, Colorspace(i),
+                                                    Colorspace(j)));
+            }
+        }
+        return ret;
+    }();
+    return plans[src_space * NUM_COLORSPACES + dst_space];
+}
+
+/** Apply a single conversion step to a row.
  */
-Mat convert_CIEXYZ_to_LMS(Mat src, bool forwardDirection = true)
+static void apply_conversion_step(const ConversionStep &step, Mat src, Mat dst)
 {
-    Mat trans_mat = (Mat_<float>(3,3) <<
-                     0.38971, 0.68898, -0.07868,
-                     -0.22981, 1.18340, 0.04641,
-                     0.00000, 0.00000, 1.00000);
-    Mat dst = src.clone();
+    switch (step.kind) {
+    case ConversionStep::LINEAR:
+        transform(src, dst, step.m);
+        break;
+    case ConversionStep::LOG:
+        log(src, dst);
+        break;
+    case ConversionStep::EXP:
+        exp(src, dst);
+        break;
+    case ConversionStep::CVT:
+        cvtColor(src, dst, step.code);
+        break;
+    }
+}
+
+/** Apply a conversion plan to a block of 3-channel float rows.
+ *  Intermediate results live in two row-sized scratch buffers, so each
+ *  pixel of src and dst is touched once regardless of the plan length.
+ */
+void apply_conversion_plan(const ConversionPlan &plan, Mat src, Mat dst)
+{
+    CV_Assert(src.type() == CV_32FC3 && dst.type() == CV_32FC3);
+    CV_Assert(src.rows == dst.rows && src.cols == dst.cols);
+
+    if (plan.empty()) {
+        if (src.data != dst.data)
+            src.copyTo(dst);
+        return;
+    }
+
+    Mat buf[2] = {Mat(1, src.cols, CV_32FC3), Mat(1, src.cols, CV_32FC3)};
     for (int i = 0; i < src.rows; i++) {
-        for (int j = 0; j < src.cols; j++) {
-            Vec3f& s = src.at<Vec3f>(i, j);
-            Mat t = (forwardDirection ? trans_mat : trans_mat.inv()) * Mat(s);
-            dst.at<Vec3f>(i, j).val[0] = t.at<float>(0, 0);
-            dst.at<Vec3f>(i, j).val[1] = t.at<float>(1, 0);
-            dst.at<Vec3f>(i, j).val[2] = t.at<float>(2, 0);
+        Mat in = src.row(i);
+        for (int k = 0; k < plan.size(); k++) {
+            Mat out = (k + 1 == plan.size()) ? dst.row(i) : buf[k % 2];
+            apply_conversion_step(plan[k], in, out);
+            in = out;
         }
     }
+}
+
+/** General colorspace conversion funtion.
+ *  Converts a 3-channel float matrix along the shortest path of the
+ *  conversion graph in a single pass, in row bands on the pool if given.
+ *  (returns src itself if the spaces are the same)
+ *  E.g. BGR -> Ruderman's lαβ folds BGR -> XYZ -> LMS into a single matrix,
+ *  then each row goes through (matrix, log, matrix); pixels with a
+ *  non-positive LMS component are as undefined as log() is.
+ */
+Mat convert_colorspace(Mat src, Colorspace src_space, Colorspace dst_space,
+                       ThreadPool *pool)
+{
+    if (src_space == dst_space)
+        return src;
+
+    const ConversionPlan &plan = get_conversion_plan(src_space, dst_space);
+    Mat dst(src.rows, src.cols, CV_32FC3);
+    parallel_for_bands(pool, src.rows, [&](int band, int begin, int end) {
+        apply_conversion_plan(plan, src.rowRange(begin, end),
+                              dst.rowRange(begin, end));
+    });
     return dst;
 }
 
-/** Convert a 3-channel matrix from LMS space to Ruderman's lαβ space.
- *  Reference:
- *    E. Reinhard and T. Pouli, "Colour Spaces for Colour Transfer". 2011.
+/** Return true if a conversion is smooth enough to be sampled by a LUT.
+ *  (hue is periodic, so HSV and HLS cannot be interpolated across the
+ *  wrap-around)
  */
-Mat convert_LMS_to_Ruderman_lab(Mat src, bool forwardDirection = true)
-{
-    Mat trans_mat1 = (Mat_<float>(3,3) <<
-                      1, 1, 1,
-                      1, 1, -2,
-                      1, -1, 0);
-    Mat trans_mat2 = (Mat_<float>(3,3) <<
-                      1. / sqrt(3), 0, 0,
-                      0, 1. / sqrt(6), 0,
-                      0, 0, 1. / sqrt(2));
-    Mat dst = src.clone();
-    if (forwardDirection)
-        log(dst, dst);
-    for (int i = 0; i < dst.rows; i++) {
-        for (int j = 0; j < dst.cols; j++) {
-            Vec3f& s = dst.at<Vec3f>(i, j);
-            Mat t = (forwardDirection ? trans_mat2 * (trans_mat1 * Mat(s))
-                     : trans_mat1.inv() * (trans_mat2.inv() * Mat(s)));
-            dst.at<Vec3f>(i, j).val[0] = t.at<float>(0, 0);
-            dst.at<Vec3f>(i, j).val[1] = t.at<float>(1, 0);
-            dst.at<Vec3f>(i, j).val[2] = t.at<float>(2, 0);
+bool color_lut_supported(Colorspace src_space, Colorspace dst_space)
+{
+    return src_space != HSV && src_space != HLS &&
+        dst_space != HSV && dst_space != HLS;
+}
+
+/** Build the 3D LUT sampling a conversion plan over the 8-bit cube.
+ *  Grid nodes sit on 8-bit codes spaced quadratically (denser near 0, where
+ *  log() and the cube root of CIELAB are steepest), so the interpolation is
+ *  exact on every node and each code maps to a fixed cell and weight.
+ */
+static void build_color_lut(ColorLUT &lut, Colorspace src_space,
+                            Colorspace dst_space)
+{
+    const int n = COLOR_LUT_NODES;
+    const ConversionPlan &plan = get_conversion_plan(src_space, dst_space);
+
+    lut.node.resize(n);
+    for (int k = 0; k < n; k++) {
+        double t = double(k) / (n - 1);
+        lut.node[k] = cvRound(255 * t * t);
+        if (k > 0 && lut.node[k] <= lut.node[k - 1])
+            lut.node[k] = lut.node[k - 1] + 1;
+    }
+
+    lut.cell.resize(256);
+    lut.weight.resize(256);
+    for (int v = 0, k = 0; v < 256; v++) {
+        while (k < n - 2 && v >= lut.node[k + 1])
+            k++;
+        lut.cell[v] = k;
+        lut.weight[v] = float(v - lut.node[k]) /
+            (lut.node[k + 1] - lut.node[k]);
+    }
+
+    Mat samples(1, n * n * n, CV_32FC3);
+    Vec3f *p = samples.ptr<Vec3f>(0);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++, p++) {
+                *p = Vec3f(lut.node[i] / 255.f, lut.node[j] / 255.f,
+                           lut.node[k] / 255.f);
+            }
         }
     }
-    if (!forwardDirection)
-        exp(dst, dst);
-    return dst;
+    Mat inputs = samples.clone();
+    apply_conversion_plan(plan, samples, samples);
+
+    // log(0) is undefined: resample such nodes (black, for plans through
+    // LMS) at half a code value, so that they can still be interpolated
+    for (int i = 0; i < samples.cols; i++) {
+        Vec3f &v = samples.at<Vec3f>(0, i);
+        if (!std::isfinite(v[0]) || !std::isfinite(v[1]) ||
+            !std::isfinite(v[2])) {
+            Vec3f x = inputs.at<Vec3f>(0, i);
+            Mat node_sample(1, 1, CV_32FC3);
+            node_sample.at<Vec3f>(0, 0) = Vec3f(max(x[0], .5f / 255),
+                                                max(x[1], .5f / 255),
+                                                max(x[2], .5f / 255));
+            apply_conversion_plan(plan, node_sample, node_sample);
+            v = node_sample.at<Vec3f>(0, 0);
+        }
+    }
+
+    const float *q = samples.ptr<float>(0);
+    lut.table.assign(q, q + n * n * n * 3);
 }
 
-/** General colorspace conversion funtion.
+/** Return the 3D LUT between two colorspaces.
+ *  Each LUT is built on first use and cached.
  */
-Mat convert_colorspace(Mat src, Colorspace src_space, Colorspace dst_space)
+const ColorLUT &get_color_lut(Colorspace src_space, Colorspace dst_space)
 {
-    if (src_space == CIEXYZ && dst_space == LMS) {
-        return convert_CIEXYZ_to_LMS(src, true);
+    static ColorLUT luts[NUM_COLORSPACES * NUM_COLORSPACES];
+    static std::once_flag flags[NUM_COLORSPACES * NUM_COLORSPACES];
 
-    } else if (src_space == LMS && dst_space == CIEXYZ) {
-        return convert_CIEXYZ_to_LMS(src, false);
+    int i = src_space * NUM_COLORSPACES + dst_space;
+    std::call_once(flags[i], build_color_lut, std::ref(luts[i]),
+                   src_space, dst_space);
+    return luts[i];
+}
 
-    } else if (src_space == LMS && dst_space == Ruderman_lab) {
-        return convert_LMS_to_Ruderman_lab(src, true);
+/** Convert a block of 8-bit 3-channel rows to float through a 3D LUT.
+ *  (trilinear interpolation; src is CV_8UC3, dst is CV_32FC3)
+ */
+void apply_color_lut(const ColorLUT &lut, Mat src, Mat dst)
+{
+    CV_Assert(src.type() == CV_8UC3 && dst.type() == CV_32FC3);
+    CV_Assert(src.rows == dst.rows && src.cols == dst.cols);
+
+    const int n = COLOR_LUT_NODES;
+    const int dk = 3, dj = n * 3, di = n * n * 3;
+    const float *table = lut.table.data();
+    const int *cell = lut.cell.data();
+    const float *weight = lut.weight.data();
+
+    for (int y = 0; y < src.rows; y++) {
+        const uchar *s = src.ptr<uchar>(y);
+        float *d = dst.ptr<float>(y);
+        for (int x = 0; x < src.cols; x++, s += 3, d += 3) {
+            const float *t = table +
+                cell[s[0]] * di + cell[s[1]] * dj + cell[s[2]] * dk;
+            float wi = weight[s[0]], wj = weight[s[1]], wk = weight[s[2]];
+            for (int c = 0; c < 3; c++) {
+                float c00 = t[c] + wk * (t[dk + c] - t[c]);
+                float c01 = t[dj + c] + wk * (t[dj + dk + c] - t[dj + c]);
+                float c10 = t[di + c] + wk * (t[di + dk + c] - t[di + c]);
+                float c11 = t[di + dj + c] +
+                    wk * (t[di + dj + dk + c] - t[di + dj + c]);
+                float c0 = c00 + wj * (c01 - c00);
+                float c1 = c10 + wj * (c11 - c10);
+                d[c] = c0 + wi * (c1 - c0);
+            }
+        }
+    }
+}
 
-    } else if (src_space == Ruderman_lab && dst_space == LMS) {
-        return convert_LMS_to_Ruderman_lab(src, false);
+/** Colorspace conversion of an 8-bit 3-channel matrix into a float matrix
+ *  of the same size, as convert_colorspace() would for src scaled to
+ *  [0,1]: through the 3D LUT when supported, otherwise through the exact
+ *  plan row by row. Runs in row bands on the pool if given.
+ *  The two paths differ where the exact result is not finite: a channel 0
+ *  through log() (e.g. black, to lαβ) is -inf exactly, but finite through
+ *  the LUT, whose nodes there are sampled at half a code value (see
+ *  build_color_lut). Elsewhere they differ by the interpolation error,
+ *  which :benchmark lut measures.
+ */
+void convert_colorspace_8u(Mat src, Mat dst, Colorspace src_space,
+                           Colorspace dst_space, ThreadPool *pool)
+{
+    CV_Assert(src.type() == CV_8UC3 && dst.type() == CV_32FC3);
+    CV_Assert(src.rows == dst.rows && src.cols == dst.cols);
 
+    if (color_lut_supported(src_space, dst_space)) {
+        const ColorLUT &lut = get_color_lut(src_space, dst_space);
+        parallel_for_bands(pool, src.rows, [&](int band, int begin, int end) {
+            apply_color_lut(lut, src.rowRange(begin, end),
+                            dst.rowRange(begin, end));
+        });
     } else {
-        return src; // FIXME:
+        const ConversionPlan &plan = get_conversion_plan(src_space, dst_space);
+        parallel_for_bands(pool, src.rows, [&](int band, int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                Mat dst_row = dst.row(i);
+                src.row(i).convertTo(dst_row, CV_32FC3, 1. / 255);
+                apply_conversion_plan(plan, dst_row, dst_row);
+            }
+        });
+    }
+}
+
+/** Colorspace conversion of an 8-bit 3-channel matrix.
+ *  Returns a float matrix without allocating a full-size float copy of src.
+ */
+Mat convert_colorspace_8u(Mat src, Colorspace src_space, Colorspace dst_space,
+                          ThreadPool *pool)
+{
+    Mat dst(src.rows, src.cols, CV_32FC3);
+    convert_colorspace_8u(src, dst, src_space, dst_space, pool);
+    return dst;
+}
+
+/** Compare the LUT path of convert_colorspace_8u() against its exact path
+ *  (serially) on an 8-bit 3-channel matrix.
+ *  (an empty matrix stands for all 2^24 colors of the 8-bit cube)
+ *  max_error is the largest absolute difference of any channel, ignoring
+ *  the channels where the exact result is not finite, which are counted.
+ */
+ColorLUTBenchmark benchmark_color_lut(Mat src, Colorspace src_space,
+                                      Colorspace dst_space)
+{
+    if (src.empty()) {
+        src.create(4096, 4096, CV_8UC3);
+        for (int i = 0; i < src.rows; i++) {
+            Vec3b *p = src.ptr<Vec3b>(i);
+            for (int j = 0; j < src.cols; j++) {
+                int v = i * src.cols + j;
+                p[j] = Vec3b(v & 0xff, (v >> 8) & 0xff, v >> 16);
+            }
+        }
+    }
+
+    ColorLUTBenchmark ret;
+    get_color_lut(src_space, dst_space); // not part of the timing
+
+    const ConversionPlan &plan = get_conversion_plan(src_space, dst_space);
+    Mat exact(src.rows, src.cols, CV_32FC3);
+    Mat approx(src.rows, src.cols, CV_32FC3);
+    double t0 = (double)getTickCount();
+    for (int i = 0; i < src.rows; i++) {
+        Mat exact_row = exact.row(i);
+        src.row(i).convertTo(exact_row, CV_32FC3, 1. / 255);
+        apply_conversion_plan(plan, exact_row, exact_row);
+    }
+    double t1 = (double)getTickCount();
+    convert_colorspace_8u(src, approx, src_space, dst_space);
+    double t2 = (double)getTickCount();
+
+    ret.exact_ms = (t1 - t0) * 1000. / getTickFrequency();
+    ret.lut_ms = (t2 - t1) * 1000. / getTickFrequency();
+    ret.max_error = 0;
+    ret.not_finite = 0;
+    for (int i = 0; i < src.rows; i++) {
+        const float *e = exact.ptr<float>(i);
+        const float *a = approx.ptr<float>(i);
+        for (int j = 0; j < src.cols * 3; j++) {
+            if (std::isfinite(e[j]))
+                ret.max_error = max(ret.max_error,
+                                    (double)std::abs(e[j] - a[j]));
+            else
+                ret.not_finite++;
+        }
     }
+    return ret;
 }
 
 
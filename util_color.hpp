@@ -2,19 +2,25 @@
 #ifndef _UTIL_COLOR_HPP
 #define _UTIL_COLOR_HPP
 
+#include "util_thread.hpp"
+
 #include <opencv2/opencv.hpp>
 
 #include <string>
+#include <vector>
 
 using namespace cv;
 
 using std::string;
+using std::vector;
+using util_thread::ThreadPool;
 
 namespace util_color {
 
 enum Colorspace {
     RGB, BGR, HSV, HLS, YCrCb, CIEXYZ, CIELAB, LMS, Ruderman_lab
 };
+const int NUM_COLORSPACES = Ruderman_lab + 1;
 
 const std::unordered_map<string, Colorspace>
 COLORSPACE_STRINGS = {
@@ -29,14 +35,52 @@ COLORSPACE_STRINGS = {
     {"Ruderman_lab", Ruderman_lab}
 };
 
+/** ConversionStep is a single pixel-wise step of a colorspace conversion.
+ */
+struct ConversionStep {
+    enum Kind { LINEAR, LOG, EXP, CVT };
+    Kind kind;
+    Matx33f m; // LINEAR: 3x3 matrix applied to each pixel
+    int code; // CVT: cvtColor() conversion code
+};
+
+/** ConversionPlan is the sequence of steps converting between two
+ *  colorspaces, with adjacent linear steps folded into one.
+ */
+typedef vector<ConversionStep> ConversionPlan;
+
+/** ColorLUT samples a conversion plan on a 3D grid over the 8-bit cube.
+ */
+const int COLOR_LUT_NODES = 33;
+struct ColorLUT {
+    vector<int> node; // 8-bit code of each grid node along an axis
+    vector<int> cell; // grid cell containing each 8-bit code
+    vector<float> weight; // position of each 8-bit code within its cell
+    vector<float> table; // COLOR_LUT_NODES^3 samples x 3 channels
+};
+
+/** ColorLUTBenchmark reports the speed and accuracy of the LUT path.
+ */
+struct ColorLUTBenchmark {
+    double exact_ms, lut_ms, max_error;
+    size_t not_finite; // channels whose exact result is not finite
+};
+
 string rgb_to_hex(unsigned char, unsigned char, unsigned char);
 float alpha_to_opacity(unsigned char);
 string alpha_to_opacity_percentage(unsigned char);
 
-Mat convert_BGR_to_CIEXYZ(Mat, bool);
-Mat convert_CIEXYZ_to_LMS(Mat, bool);
-Mat convert_LMS_to_Ruderman_lab(Mat, bool);
-Mat convert_colorspace(Mat, Colorspace, Colorspace);
+const ConversionPlan &get_conversion_plan(Colorspace, Colorspace);
+void apply_conversion_plan(const ConversionPlan &, Mat, Mat);
+Mat convert_colorspace(Mat, Colorspace, Colorspace, ThreadPool * = nullptr);
+
+bool color_lut_supported(Colorspace, Colorspace);
+const ColorLUT &get_color_lut(Colorspace, Colorspace);
+void apply_color_lut(const ColorLUT &, Mat, Mat);
+void convert_colorspace_8u(Mat, Mat, Colorspace, Colorspace,
+                           ThreadPool * = nullptr);
+Mat convert_colorspace_8u(Mat, Colorspace, Colorspace, ThreadPool * = nullptr);
+ColorLUTBenchmark benchmark_color_lut(Mat, Colorspace, Colorspace);
 
 
 
@@ -0,0 +1,244 @@
+#include "util_hist.hpp"
+#include "util_thread.hpp"
+
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+
+using util_thread::band_count;
+using util_thread::parallel_for_bands;
+
+namespace util_hist {
+
+/** Add the histograms of an 8-bit image with CN channels to a flat array
+ *  of CN x 256 bins.
+ */
+template<int CN>
+static void accumulate_histograms_cn(unsigned *flat, const Mat &mat)
+{
+    for (int i = 0; i < mat.rows; i++) {
+        const uchar *p = mat.ptr<uchar>(i);
+        for (int j = 0; j < mat.cols; j++, p += CN) {
+            for (int c = 0; c < CN; c++)
+                flat[c * HIST_BINS + p[c]]++;
+        }
+    }
+}
+
+/** Single-channel specialization: four interleaved sub-histograms break the
+ *  dependency between consecutive increments of the same bin.
+ */
+template<>
+void accumulate_histograms_cn<1>(unsigned *flat, const Mat &mat)
+{
+    unsigned sub[4][HIST_BINS] = {{0}};
+    for (int i = 0; i < mat.rows; i++) {
+        const uchar *p = mat.ptr<uchar>(i);
+        int j = 0;
+        for (; j + 4 <= mat.cols; j += 4) {
+            sub[0][p[j]]++;
+            sub[1][p[j + 1]]++;
+            sub[2][p[j + 2]]++;
+            sub[3][p[j + 3]]++;
+        }
+        for (; j < mat.cols; j++)
+            sub[0][p[j]]++;
+    }
+    for (int k = 0; k < HIST_BINS; k++)
+        flat[k] += sub[0][k] + sub[1][k] + sub[2][k] + sub[3][k];
+}
+
+/** Add the histograms of an 8-bit image to a flat array of channels x 256
+ *  bins.
+ */
+static void accumulate_histograms(unsigned *flat, const Mat &mat)
+{
+    CV_Assert(mat.depth() == CV_8U);
+
+    switch (mat.channels()) {
+    case 1: accumulate_histograms_cn<1>(flat, mat); break;
+    case 2: accumulate_histograms_cn<2>(flat, mat); break;
+    case 3: accumulate_histograms_cn<3>(flat, mat); break;
+    case 4: accumulate_histograms_cn<4>(flat, mat); break;
+    default: CV_Assert(!"unsupported number of channels");
+    }
+}
+
+/** Constructor of IntegralHistogram. (given the image and block size)
+ */
+IntegralHistogram::IntegralHistogram(Mat mat, int block, ThreadPool *pool)
+{
+    CV_Assert(mat.depth() == CV_8U);
+
+    this->mat = mat;
+    this->block = block;
+    this->grid_rows = (mat.rows + block - 1) / block;
+    this->grid_cols = (mat.cols + block - 1) / block;
+    this->channels = mat.channels();
+    this->table.assign((size_t)(grid_rows + 1) * (grid_cols + 1) *
+                       channels * HIST_BINS, 0);
+
+    // histogram of each block, stored at (by + 1, bx + 1)
+    parallel_for_bands(pool, grid_rows, [&](int band, int begin, int end) {
+        for (int by = begin; by < end; by++) {
+            for (int bx = 0; bx < grid_cols; bx++) {
+                Rect r(bx * block, by * block,
+                       min(block, mat.cols - bx * block),
+                       min(block, mat.rows - by * block));
+                accumulate_histograms(at(by + 1, bx + 1), mat(r));
+            }
+        }
+    }, 1);
+
+    // prefix sums along x, then along y
+    int n = channels * HIST_BINS;
+    for (int by = 1; by <= grid_rows; by++) {
+        for (int bx = 1; bx <= grid_cols; bx++) {
+            unsigned *h = at(by, bx), *left = at(by, bx - 1);
+            for (int k = 0; k < n; k++)
+                h[k] += left[k];
+        }
+    }
+    for (int by = 1; by <= grid_rows; by++) {
+        for (int bx = 1; bx <= grid_cols; bx++) {
+            unsigned *h = at(by, bx), *up = at(by - 1, bx);
+            for (int k = 0; k < n; k++)
+                h[k] += up[k];
+        }
+    }
+}
+
+/** Destructor of IntegralHistogram.
+ */
+IntegralHistogram::~IntegralHistogram()
+{
+}
+
+/** Return the histograms of a rectangle of the image.
+ */
+Histograms IntegralHistogram::query(Rect rect)
+{
+    rect &= Rect(0, 0, mat.cols, mat.rows);
+    Histograms ret(channels, vector<unsigned>(HIST_BINS, 0));
+    if (rect.area() == 0)
+        return ret;
+
+    int x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+    // whole blocks inside the rectangle (the last one may be partial)
+    int bx0 = (rect.x + block - 1) / block;
+    int by0 = (rect.y + block - 1) / block;
+    int bx1 = x1 == mat.cols ? grid_cols : x1 / block;
+    int by1 = y1 == mat.rows ? grid_rows : y1 / block;
+    if (bx0 >= bx1 || by0 >= by1) {
+        scan(ret, rect);
+        return ret;
+    }
+
+    const unsigned *a = at(by0, bx0), *b = at(by0, bx1);
+    const unsigned *c = at(by1, bx0), *d = at(by1, bx1);
+    for (int ch = 0; ch < channels; ch++) {
+        for (int k = 0; k < HIST_BINS; k++) {
+            int i = ch * HIST_BINS + k;
+            ret[ch][k] = d[i] - b[i] - c[i] + a[i];
+        }
+    }
+
+    // edge strips: top and bottom (full width), left and right
+    int ix0 = bx0 * block, ix1 = min(bx1 * block, mat.cols);
+    int iy0 = by0 * block, iy1 = min(by1 * block, mat.rows);
+    scan(ret, Rect(rect.x, rect.y, rect.width, iy0 - rect.y));
+    scan(ret, Rect(rect.x, iy1, rect.width, y1 - iy1));
+    scan(ret, Rect(rect.x, iy0, ix0 - rect.x, iy1 - iy0));
+    scan(ret, Rect(ix1, iy0, x1 - ix1, iy1 - iy0));
+    return ret;
+}
+
+/** Return the cumulative histograms at a grid position.
+ */
+unsigned *IntegralHistogram::at(int by, int bx)
+{
+    return table.data() +
+        ((size_t)by * (grid_cols + 1) + bx) * channels * HIST_BINS;
+}
+
+/** Add the histograms of a rectangle, scanning it pixel by pixel.
+ */
+void IntegralHistogram::scan(Histograms &hists, Rect rect)
+{
+    if (rect.width > 0 && rect.height > 0)
+        add_histograms(hists, mat(rect));
+}
+
+/** Add the histograms of an 8-bit image to hists, one per channel.
+ *  (the block-level primitive of compute_histograms)
+ */
+void add_histograms(Histograms &hists, Mat mat)
+{
+    int cn = mat.channels();
+    vector<unsigned> flat(cn * HIST_BINS, 0);
+    accumulate_histograms(flat.data(), mat);
+    for (int c = 0; c < cn; c++) {
+        for (int k = 0; k < HIST_BINS; k++)
+            hists[c][k] += flat[c * HIST_BINS + k];
+    }
+}
+
+/** Add the histogram of one channel of an 8-bit image to hist. (the other
+ *  channels are skipped, not counted)
+ */
+void add_channel_histogram(vector<unsigned> &hist, Mat mat, int channel)
+{
+    int cn = mat.channels();
+    unsigned *h = hist.data();
+    for (int i = 0; i < mat.rows; i++) {
+        const uchar *p = mat.ptr<uchar>(i) + channel;
+        for (int j = 0; j < mat.cols; j++, p += cn)
+            h[*p]++;
+    }
+}
+
+/** Compute the histograms of an 8-bit image with 1 to 4 channels in a
+ *  single pass over its interleaved data (no copy, no split). Row bands get
+ *  their own sub-histograms, summed at the end, so threads never contend.
+ */
+Histograms compute_histograms(Mat mat, ThreadPool *pool)
+{
+    int cn = mat.channels();
+    vector< vector<unsigned> > band_flat(band_count(mat.rows));
+    parallel_for_bands(pool, mat.rows, [&](int band, int begin, int end) {
+        band_flat[band].assign(cn * HIST_BINS, 0);
+        accumulate_histograms(band_flat[band].data(), mat.rowRange(begin, end));
+    });
+
+    Histograms ret(cn, vector<unsigned>(HIST_BINS, 0));
+    for (const auto &flat : band_flat) {
+        for (int c = 0; c < cn; c++) {
+            for (int k = 0; k < HIST_BINS; k++)
+                ret[c][k] += flat[c * HIST_BINS + k];
+        }
+    }
+    return ret;
+}
+
+/** Compute the mean and standard deviation of each channel from its
+ *  histogram. (exact for 8-bit data, same as meanStdDev)
+ */
+void histogram_statistics(const Histograms &hists, Scalar &mean,
+                          Scalar &stddev)
+{
+    mean = stddev = Scalar::all(0);
+    for (int c = 0; c < hists.size() && c < 4; c++) {
+        double n = 0, sum = 0, sqsum = 0;
+        for (int k = 0; k < HIST_BINS; k++) {
+            n += hists[c][k];
+            sum += (double)k * hists[c][k];
+            sqsum += (double)k * k * hists[c][k];
+        }
+        if (n == 0)
+            continue;
+        mean.val[c] = sum / n;
+        stddev.val[c] = sqrt(max(0., sqsum / n - mean.val[c] * mean.val[c]));
+    }
+}
+
+} // namespace util_hist
@@ -0,0 +1,54 @@
+#ifndef _UTIL_HIST_HPP
+#define _UTIL_HIST_HPP
+
+#include "util_thread.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+using namespace cv;
+
+using std::vector;
+using util_thread::ThreadPool;
+
+namespace util_hist {
+
+const int HIST_BINS = 256;
+
+/** Histograms holds one 256-bin histogram per channel of an 8-bit image.
+ */
+typedef vector< vector<unsigned> > Histograms;
+
+/** IntegralHistogram answers the histograms of any rectangle of an 8-bit
+ *  image from cumulative histograms of square blocks: the block-aligned
+ *  interior costs four lookups per bin, and only the strips along the edges
+ *  (narrower than a block) are scanned pixel by pixel.
+ */
+class IntegralHistogram {
+
+public:
+    IntegralHistogram(Mat, int, ThreadPool *);
+    ~IntegralHistogram();
+
+    Histograms query(Rect);
+
+private:
+    Mat mat;
+    int block, grid_rows, grid_cols, channels;
+    // (grid_rows + 1) x (grid_cols + 1) cumulative histograms
+    vector<unsigned> table;
+
+    unsigned *at(int, int);
+    void scan(Histograms &, Rect);
+
+};
+
+void add_histograms(Histograms &, Mat);
+void add_channel_histogram(vector<unsigned> &, Mat, int);
+Histograms compute_histograms(Mat, ThreadPool * = nullptr);
+void histogram_statistics(const Histograms &, Scalar &, Scalar &);
+
+} // namespace util_hist
+
+#endif // _UTIL_HIST_HPP
@@ -0,0 +1,149 @@
+#include "util_io.hpp"
+#include "util_memory.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+using util_memory::map_file;
+
+namespace util_io {
+
+/** Map an uncompressed 8-bit image from a raw file. (given its size, the
+ *  number of interleaved channels and the offset of the first pixel)
+ *  Pixels are read on access; writes go to private copies.
+ */
+Mat map_raw(const string &file_name, int cols, int rows, int channels,
+            size_t offset)
+{
+    if (cols <= 0 || rows <= 0 || channels < 1 || channels > 4)
+        return Mat();
+    return map_file(file_name, rows, cols, CV_8UC(channels), offset);
+}
+
+/** Read the next integer of a PNM header, skipping whitespace and comments.
+ *  (-1 on error)
+ */
+static int read_pnm_value(FILE *f)
+{
+    int c = fgetc(f);
+    while (c != EOF && (isspace(c) || c == '#')) {
+        if (c == '#')
+            while (c != EOF && c != '\n')
+                c = fgetc(f);
+        c = fgetc(f);
+    }
+    if (!isdigit(c))
+        return -1;
+    int value = 0;
+    while (isdigit(c)) {
+        value = value * 10 + (c - '0');
+        c = fgetc(f);
+    }
+    // c is the single whitespace after the value
+    return isspace(c) ? value : -1;
+}
+
+/** Map a binary 8-bit PGM (P5) or PPM (P6) file.
+ *  PGM pixels are used in place; PPM pixels are RGB, so they are swapped
+ *  into a new BGR matrix (one copy, no decode).
+ *  (empty if the file is not such a PNM)
+ */
+Mat map_pnm(const string &file_name)
+{
+    FILE *f = fopen(file_name.c_str(), "rb");
+    if (!f)
+        return Mat();
+    char magic[2] = {0, 0};
+    int cols = -1, rows = -1, maxval = -1;
+    if (fread(magic, 1, 2, f) == 2 && magic[0] == 'P' &&
+        (magic[1] == '5' || magic[1] == '6')) {
+        cols = read_pnm_value(f);
+        rows = read_pnm_value(f);
+        maxval = read_pnm_value(f);
+    }
+    long offset = ftell(f);
+    fclose(f);
+    if (cols <= 0 || rows <= 0 || maxval <= 0 || maxval > 255)
+        return Mat(); // (16-bit PNM is left to imread)
+
+    Mat mat = map_raw(file_name, cols, rows, magic[1] == '6' ? 3 : 1, offset);
+    if (magic[1] == '6' && !mat.empty()) {
+        Mat bgr;
+        cvtColor(mat, bgr, COLOR_RGB2BGR);
+        return bgr;
+    }
+    return mat;
+}
+
+/** Map a NumPy .npy file of unsigned bytes in C order, of shape (rows, cols)
+ *  or (rows, cols, channels) with 1 to 4 channels. Channels are taken in the
+ *  order stored (BGR for 3 channels, like OpenCV).
+ *  (empty if the file is not such an array)
+ */
+Mat map_npy(const string &file_name)
+{
+    FILE *f = fopen(file_name.c_str(), "rb");
+    if (!f)
+        return Mat();
+    unsigned char prefix[12];
+    size_t prefix_size = fread(prefix, 1, sizeof(prefix), f);
+    size_t header_len = 0, header_start = 0;
+    if (prefix_size >= 10 && !memcmp(prefix, "\x93NUMPY", 6)) {
+        if (prefix[6] == 1) { // version 1.0: 16-bit header length
+            header_len = prefix[8] | prefix[9] << 8;
+            header_start = 10;
+        } else if (prefix_size == 12) { // version 2.0, 3.0: 32-bit
+            header_len = prefix[8] | prefix[9] << 8 | prefix[10] << 16 |
+                         (size_t)prefix[11] << 24;
+            header_start = 12;
+        }
+    }
+    string header(header_len, '\0');
+    bool is_ok = header_start && fseek(f, header_start, SEEK_SET) == 0 &&
+                 fread(&header[0], 1, header_len, f) == header_len;
+    fclose(f);
+    if (!is_ok)
+        return Mat();
+
+    // e.g. {'descr': '|u1', 'fortran_order': False, 'shape': (480, 640, 3), }
+    header.erase(std::remove(header.begin(), header.end(), ' '), header.end());
+    if (header.find("'descr':'|u1'") == string::npos &&
+        header.find("'descr':'<u1'") == string::npos)
+        return Mat();
+    if (header.find("'fortran_order':False") == string::npos)
+        return Mat();
+    size_t shape_at = header.find("'shape':(");
+    if (shape_at == string::npos)
+        return Mat();
+    int dims[3] = {0, 0, 1};
+    int ndims = sscanf(header.c_str() + shape_at + 9, "%d,%d,%d",
+                       &dims[0], &dims[1], &dims[2]);
+    if (ndims < 2)
+        return Mat();
+
+    return map_raw(file_name, dims[1], dims[0], dims[2],
+                   header_start + header_len);
+}
+
+/** Map an uncompressed image file (binary PGM/PPM or .npy), recognized by
+ *  its magic. (empty if it is not one of these, to fall back to imread)
+ */
+Mat map_image(const string &file_name)
+{
+    FILE *f = fopen(file_name.c_str(), "rb");
+    if (!f)
+        return Mat();
+    char magic[6] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    if (n >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6'))
+        return map_pnm(file_name);
+    if (n == 6 && !memcmp(magic, "\x93NUMPY", 6))
+        return map_npy(file_name);
+    return Mat();
+}
+
+} // namespace util_io
@@ -0,0 +1,21 @@
+#ifndef _UTIL_IO_HPP
+#define _UTIL_IO_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+
+using namespace cv;
+
+using std::string;
+
+namespace util_io {
+
+Mat map_raw(const string &, int, int, int, size_t = 0);
+Mat map_pnm(const string &);
+Mat map_npy(const string &);
+Mat map_image(const string &);
+
+} // namespace util_io
+
+#endif // _UTIL_IO_HPP
@@ -0,0 +1,307 @@
+#include "util_memory.hpp"
+
+#include <cstdio>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace util_memory {
+
+/** Constructor of PoolAllocator.
+ *  (given the most bytes kept in free lists, and whether to use huge pages)
+ */
+PoolAllocator::PoolAllocator(size_t max_cached_bytes, bool is_huge_pages)
+{
+    this->max_cached_bytes = max_cached_bytes;
+    this->is_huge_pages = is_huge_pages;
+}
+
+/** Destructor of PoolAllocator. (buffers still in use are not freed)
+ */
+PoolAllocator::~PoolAllocator()
+{
+    release_cached();
+}
+
+/** Allocate the buffer of a matrix (same layout as the standard allocator).
+ */
+UMatData *PoolAllocator::allocate(int dims, const int *sizes, int type,
+                                  void *data0, size_t *step,
+                                  AllocatorAccessFlags flags,
+                                  UMatUsageFlags usage_flags) const
+{
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+        if (step) {
+            if (data0 && step[i] != CV_AUTOSTEP) {
+                CV_Assert(total <= step[i]);
+                total = step[i];
+            } else {
+                step[i] = total;
+            }
+        }
+        total *= sizes[i];
+    }
+
+    uchar *data = (uchar *)data0;
+    if (!data) {
+        if (total < POOL_MIN_BYTES) {
+            data = (uchar *)fastMalloc(total);
+        } else {
+            size_t size = class_size(total);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                vector<void *> &free_list = free_lists[size];
+                if (!free_list.empty()) {
+                    data = (uchar *)free_list.back();
+                    free_list.pop_back();
+                    counters.hits++;
+                    counters.cached_bytes -= size;
+                } else {
+                    counters.misses++;
+                }
+                counters.used_bytes += size;
+            }
+            if (!data)
+                data = (uchar *)map_buffer(size);
+        }
+    }
+
+    UMatData *u = new UMatData(this);
+    u->data = u->origdata = data;
+    u->size = total;
+    if (data0)
+        u->flags |= UMatData::USER_ALLOCATED;
+    return u;
+}
+
+/** (nothing to do for host memory)
+ */
+bool PoolAllocator::allocate(UMatData *u, AllocatorAccessFlags flags,
+                             UMatUsageFlags usage_flags) const
+{
+    return u != nullptr;
+}
+
+/** Return the buffer of a matrix to its free list. (or unmap it if the
+ *  free lists are full)
+ */
+void PoolAllocator::deallocate(UMatData *u) const
+{
+    if (!u)
+        return;
+    CV_Assert(u->urefcount == 0);
+    CV_Assert(u->refcount == 0);
+
+    if (!(u->flags & UMatData::USER_ALLOCATED)) {
+        if (u->size < POOL_MIN_BYTES) {
+            fastFree(u->origdata);
+        } else {
+            size_t size = class_size(u->size);
+            bool is_cached = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                counters.used_bytes -= size;
+                if (counters.cached_bytes + size <= max_cached_bytes) {
+                    free_lists[size].push_back(u->origdata);
+                    counters.cached_bytes += size;
+                    is_cached = true;
+                }
+            }
+            if (!is_cached)
+                unmap_buffer(u->origdata, size);
+        }
+        u->origdata = 0;
+    }
+    delete u;
+}
+
+/** Return a snapshot of the counters.
+ */
+PoolStats PoolAllocator::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+/** Unmap all buffers kept in the free lists.
+ */
+void PoolAllocator::release_cached() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : free_lists) {
+        for (void *p : entry.second)
+            unmap_buffer(p, entry.first);
+        entry.second.clear();
+    }
+    counters.cached_bytes = 0;
+}
+
+/** Return the size class of a buffer: the size rounded up to a quarter of
+ *  its power of two (at most 25% waste), and to whole huge pages if enabled.
+ */
+size_t PoolAllocator::class_size(size_t bytes) const
+{
+    int k = 63 - __builtin_clzll(bytes); // 2^k <= bytes
+    size_t step = ((size_t)1 << k) >> 2;
+    size_t size = (bytes + step - 1) / step * step;
+    if (is_huge_pages && size >= HUGE_PAGE_BYTES)
+        size = (size + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    return size;
+}
+
+/** Map a new anonymous buffer of the given size.
+ */
+void *PoolAllocator::map_buffer(size_t size) const
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+    if (is_huge_pages && size >= HUGE_PAGE_BYTES)
+        madvise(p, size, MADV_HUGEPAGE); // a hint; ignored if unsupported
+#endif
+    return p;
+}
+
+/** Unmap a buffer of the given size.
+ */
+void PoolAllocator::unmap_buffer(void *p, size_t size)
+{
+    munmap(p, size);
+}
+
+/** Create a PoolAllocator and make it the default allocator of cv::Mat.
+ *  Matrices allocated before keep their own allocator. The allocator is
+ *  intentionally leaked, since matrices may be released during static
+ *  destruction.
+ */
+PoolAllocator *install_pool_allocator(size_t max_cached_bytes,
+                                      bool is_huge_pages)
+{
+    PoolAllocator *allocator = new PoolAllocator(max_cached_bytes,
+                                                 is_huge_pages);
+    Mat::setDefaultAllocator(allocator);
+    return allocator;
+}
+
+/** Mapping records the whole mapped range behind a matrix of MappedAllocator
+ *  (it starts at a page boundary, before the data).
+ */
+struct Mapping {
+    void *addr;
+    size_t length;
+};
+
+/** Allocate with the default allocator. (mapped matrices are only created by
+ *  map_file)
+ */
+UMatData *MappedAllocator::allocate(int dims, const int *sizes, int type,
+                                    void *data0, size_t *step,
+                                    AllocatorAccessFlags flags,
+                                    UMatUsageFlags usage_flags) const
+{
+    return Mat::getDefaultAllocator()->allocate(dims, sizes, type, data0, step,
+                                                flags, usage_flags);
+}
+
+/** (nothing to do for host memory)
+ */
+bool MappedAllocator::allocate(UMatData *u, AllocatorAccessFlags flags,
+                               UMatUsageFlags usage_flags) const
+{
+    return u != nullptr;
+}
+
+/** Unmap the file behind a matrix.
+ */
+void MappedAllocator::deallocate(UMatData *u) const
+{
+    if (!u)
+        return;
+    CV_Assert(u->urefcount == 0);
+    CV_Assert(u->refcount == 0);
+
+    Mapping *mapping = (Mapping *)u->userdata;
+    munmap(mapping->addr, mapping->length);
+    delete mapping;
+    delete u;
+}
+
+/** Return a matrix whose data is a private mapping of a raw file, starting
+ *  at the given byte offset. Pages are read on first access, and writes go
+ *  to private copies (the file is never modified).
+ *  (empty if the file cannot be mapped or is too short)
+ */
+Mat map_file(const std::string &file_name, int rows, int cols, int type,
+             size_t offset)
+{
+    static MappedAllocator *allocator = new MappedAllocator(); // leaked
+
+    size_t size = (size_t)rows * cols * CV_ELEM_SIZE(type);
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Mat();
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (size == 0 || file_size < 0 || (size_t)file_size < offset + size) {
+        close(fd);
+        return Mat();
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_offset = offset / page * page;
+    size_t length = offset - map_offset + size;
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, map_offset);
+    close(fd); // the mapping keeps the file open
+    if (addr == MAP_FAILED)
+        return Mat();
+
+    uchar *data = (uchar *)addr + (offset - map_offset);
+    Mat mat(rows, cols, type, data);
+    UMatData *u = new UMatData(allocator);
+    u->data = u->origdata = data;
+    u->size = size;
+    u->userdata = new Mapping{addr, length};
+    u->refcount = 1; // owned by mat from now on
+    mat.u = u;
+    mat.allocator = allocator;
+    return mat;
+}
+
+/** Return whether the data of a matrix is a file mapping made by map_file.
+ */
+bool is_mapped(const Mat &mat)
+{
+    return mat.u && dynamic_cast<const MappedAllocator *>(
+                        mat.u->currAllocator) != nullptr;
+}
+
+/** Write the data of a matrix to a raw file, row by row.
+ */
+bool write_raw(const std::string &file_name, const Mat &mat)
+{
+    FILE *f = fopen(file_name.c_str(), "wb");
+    if (!f)
+        return false;
+    bool is_ok = write_rows(f, mat);
+    is_ok = fclose(f) == 0 && is_ok;
+    return is_ok;
+}
+
+/** Write the data of a matrix at the current position of a file, row by
+ *  row. (no padding between rows)
+ */
+bool write_rows(FILE *f, const Mat &mat)
+{
+    size_t row_bytes = mat.cols * mat.elemSize();
+    for (int y = 0; y < mat.rows; y++)
+        if (fwrite(mat.ptr(y), 1, row_bytes, f) != row_bytes)
+            return false;
+    return true;
+}
+
+} // namespace util_memory
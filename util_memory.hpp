@@ -0,0 +1,96 @@
+#ifndef _UTIL_MEMORY_HPP
+#define _UTIL_MEMORY_HPP
+
+#include <opencv2/opencv.hpp>
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+using std::vector;
+
+namespace util_memory {
+
+#if CV_VERSION_MAJOR >= 4
+typedef AccessFlag AllocatorAccessFlags;
+#else
+typedef int AllocatorAccessFlags;
+#endif
+
+// buffers smaller than this go straight to fastMalloc()
+const size_t POOL_MIN_BYTES = 64 << 10;
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+/** PoolStats is a snapshot of the counters of a PoolAllocator.
+ */
+struct PoolStats {
+    size_t hits = 0; // pooled allocations served from a free list
+    size_t misses = 0; // pooled allocations that had to map new memory
+    size_t used_bytes = 0; // pooled buffers handed out
+    size_t cached_bytes = 0; // pooled buffers kept for reuse
+};
+
+/** PoolAllocator is a cv::MatAllocator keeping freed buffers in size-class
+ *  free lists (4 classes per power of two), so large matrices of recurring
+ *  sizes are reused instead of being mapped and faulted in again. Buffers of
+ *  2 MiB and more may be backed by transparent huge pages.
+ *  It must outlive every matrix it allocated, so it is never destroyed once
+ *  installed as the default allocator.
+ */
+class PoolAllocator : public MatAllocator {
+
+public:
+    PoolAllocator(size_t, bool);
+    ~PoolAllocator();
+
+    UMatData *allocate(int, const int *, int, void *, size_t *,
+                       AllocatorAccessFlags, UMatUsageFlags) const override;
+    bool allocate(UMatData *, AllocatorAccessFlags,
+                  UMatUsageFlags) const override;
+    void deallocate(UMatData *) const override;
+
+    PoolStats stats() const;
+    void release_cached() const;
+
+private:
+    size_t max_cached_bytes;
+    bool is_huge_pages;
+
+    mutable std::mutex mutex;
+    mutable std::map< size_t, vector<void *> > free_lists;
+    mutable PoolStats counters;
+
+    size_t class_size(size_t) const;
+    void *map_buffer(size_t) const;
+    static void unmap_buffer(void *, size_t);
+
+};
+
+/** MappedAllocator owns matrices whose data is a private (copy-on-write)
+ *  mapping of a file; releasing the last reference unmaps the file. Any new
+ *  allocation goes to the default allocator.
+ */
+class MappedAllocator : public MatAllocator {
+
+public:
+    UMatData *allocate(int, const int *, int, void *, size_t *,
+                       AllocatorAccessFlags, UMatUsageFlags) const override;
+    bool allocate(UMatData *, AllocatorAccessFlags,
+                  UMatUsageFlags) const override;
+    void deallocate(UMatData *) const override;
+
+};
+
+PoolAllocator *install_pool_allocator(size_t, bool);
+Mat map_file(const std::string &, int, int, int, size_t = 0);
+bool is_mapped(const Mat &);
+bool write_raw(const std::string &, const Mat &);
+bool write_rows(FILE *, const Mat &);
+
+} // namespace util_memory
+
+#endif // _UTIL_MEMORY_HPP
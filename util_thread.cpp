@@ -0,0 +1,274 @@
+#include "util_thread.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+using std::min;
+
+namespace util_thread {
+
+static thread_local Progress *attached_progress = nullptr;
+static thread_local bool is_in_loop = false; // (running an iteration)
+
+/** Return the progress attached to the current thread. (or null)
+ */
+Progress *Progress::attached()
+{
+    return attached_progress;
+}
+
+/** Constructor of Progress::Scope.
+ */
+Progress::Scope::Scope(Progress *progress)
+{
+    previous = attached_progress;
+    attached_progress = progress;
+}
+
+/** Destructor of Progress::Scope.
+ */
+Progress::Scope::~Scope()
+{
+    attached_progress = previous;
+}
+
+/** Start a loop of n iterations in the attached progress: an outermost loop
+ *  starts a new phase. (returns whether it is outermost)
+ */
+static bool begin_loop(Progress *progress, int n)
+{
+    if (!progress || is_in_loop)
+        return false;
+    progress->done = 0;
+    progress->total = n;
+    progress->phase++;
+    return true;
+}
+
+/** Run the i-th iteration of a loop, unless the progress is cancelled
+ *  (throws Cancelled); iterations of an outermost loop are counted.
+ */
+static void run_iteration(Progress *progress, bool is_outermost,
+                          const function<void(int)> &fn, int i)
+{
+    if (progress && progress->is_cancelled)
+        throw Cancelled();
+    bool was_in_loop = is_in_loop;
+    is_in_loop = true;
+    try {
+        fn(i);
+    } catch (...) {
+        is_in_loop = was_in_loop;
+        throw;
+    }
+    is_in_loop = was_in_loop;
+    if (is_outermost)
+        progress->done++;
+}
+
+/** Constructor of ThreadPool. (given number of worker threads)
+ */
+ThreadPool::ThreadPool(int workers)
+{
+    start(workers);
+}
+
+/** Constructor of ThreadPool. (no worker threads)
+ */
+ThreadPool::ThreadPool()
+{
+}
+
+/** Destructor of ThreadPool.
+ *  Queued tasks are finished before the workers terminate.
+ */
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+/** Return the number of worker threads.
+ */
+int ThreadPool::size()
+{
+    return workers.size();
+}
+
+/** Change the number of worker threads. (waits for queued tasks)
+ */
+void ThreadPool::resize(int workers)
+{
+    stop();
+    start(workers);
+}
+
+/** Queue a task; the returned future becomes ready when it has run.
+ *  (runs the task at once if there are no worker threads)
+ */
+std::future<void> ThreadPool::submit(function<void()> fn)
+{
+    auto task = std::make_shared< std::packaged_task<void()> >(fn);
+    std::future<void> ret = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return ret;
+}
+
+/** Run fn(i) for every i in [0, n) on the workers and the calling thread,
+ *  and wait for all of them. The first exception thrown is rethrown here.
+ *  The iterations are counted in the progress attached to the calling thread
+ *  (if any), and skipped once it is cancelled.
+ */
+void ThreadPool::parallel_for(int n, function<void(int)> fn)
+{
+    struct Loop {
+        std::atomic<int> next, done;
+        int n;
+        function<void(int)> fn;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::exception_ptr error;
+        Progress *progress;
+        bool is_outermost;
+    };
+    auto loop = std::make_shared<Loop>();
+    loop->next = 0;
+    loop->done = 0;
+    loop->n = n;
+    loop->fn = fn;
+    loop->progress = Progress::attached();
+    loop->is_outermost = begin_loop(loop->progress, n);
+
+    auto run = [loop]() {
+        Progress::Scope scope(loop->progress); // (for nested loops)
+        int i;
+        while ((i = loop->next++) < loop->n) {
+            try {
+                run_iteration(loop->progress, loop->is_outermost, loop->fn, i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if (!loop->error)
+                    loop->error = std::current_exception();
+            }
+            if (++loop->done == loop->n) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                loop->cond.notify_all();
+            }
+        }
+    };
+
+    int helpers = min(size(), n - 1);
+    for (int i = 0; i < helpers; i++)
+        enqueue(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->cond.wait(lock, [&loop]() { return loop->done == loop->n; });
+    if (loop->error)
+        std::rethrow_exception(loop->error);
+}
+
+/** Start worker threads.
+ */
+void ThreadPool::start(int n)
+{
+    is_stopping = false;
+    for (int i = 0; i < n; i++)
+        workers.push_back(thread(work, this));
+}
+
+/** Stop all worker threads, after the queued tasks have run.
+ */
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopping = true;
+    }
+    cond.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+/** Queue a task for the workers. (runs it at once if there are none)
+ */
+void ThreadPool::enqueue(function<void()> fn)
+{
+    if (workers.empty()) {
+        fn();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(fn);
+    }
+    cond.notify_one();
+}
+
+/** Worker thread loop.
+ */
+void ThreadPool::work(ThreadPool *pool)
+{
+    while (true) {
+        function<void()> fn;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->cond.wait(lock, [pool]() {
+                return pool->is_stopping || !pool->tasks.empty();
+            });
+            if (pool->tasks.empty())
+                return; // stopping
+            fn = pool->tasks.front();
+            pool->tasks.pop_front();
+        }
+        fn();
+    }
+}
+
+/** Return the number of hardware threads (at least 1).
+ */
+int hardware_threads()
+{
+    int n = thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+/** Run fn(i) for every i in [0, n) on the calling thread. The iterations
+ *  are counted and cancelled through the attached progress, as those of
+ *  ThreadPool::parallel_for() are.
+ */
+void serial_for(int n, function<void(int)> fn)
+{
+    Progress *progress = Progress::attached();
+    bool is_outermost = begin_loop(progress, n);
+    for (int i = 0; i < n; i++)
+        run_iteration(progress, is_outermost, fn, i);
+}
+
+/** Return the number of bands of the given height covering some rows.
+ */
+int band_count(int rows, int band_rows)
+{
+    return (rows + band_rows - 1) / band_rows;
+}
+
+/** Split rows into bands and run fn(band, begin_row, end_row) for each,
+ *  in parallel on the pool. (serially if the pool is null)
+ */
+void parallel_for_bands(ThreadPool *pool, int rows,
+                        function<void(int, int, int)> fn, int band_rows)
+{
+    int n = band_count(rows, band_rows);
+    auto run = [&](int band) {
+        int begin = band * band_rows;
+        fn(band, begin, min(rows, begin + band_rows));
+    };
+    if (pool)
+        pool->parallel_for(n, run);
+    else
+        serial_for(n, run);
+}
+
+} // namespace util_thread
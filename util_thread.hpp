@@ -0,0 +1,107 @@
+#ifndef _UTIL_THREAD_HPP
+#define _UTIL_THREAD_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using std::function;
+using std::thread;
+using std::vector;
+
+namespace util_thread {
+
+/** Default height (in rows) of the bands an image is split into.
+ *  Bands do not depend on the number of threads, so reductions merged in
+ *  band order give the same result whatever the thread count.
+ */
+const int BAND_ROWS = 64;
+
+/** Progress counts the iterations of parallel_for() run on behalf of a task,
+ *  (e.g. the bands or tiles of a background procedure) and lets the task be
+ *  cancelled between them. It applies to the loops started on the thread it
+ *  is attached to, and to the loops nested in their iterations.
+ *  Each outermost loop is a phase of the task, (e.g. a reduction pass, then
+ *  the pass writing the result) whose iterations are counted; nested loops
+ *  are only checked for cancellation.
+ */
+class Progress {
+
+public:
+    std::atomic<int> phase{0}; // outermost loops started
+    std::atomic<long> done{0}; // iterations run in the current phase
+    std::atomic<long> total{0}; // iterations of the current phase
+    std::atomic<bool> is_cancelled{false};
+
+    static Progress *attached();
+
+    /** Scope attaches a progress to the current thread while it lives.
+     */
+    class Scope {
+    public:
+        Scope(Progress *);
+        ~Scope();
+    private:
+        Progress *previous;
+    };
+
+};
+
+/** Cancelled is thrown by parallel_for() when the attached progress is
+ *  cancelled, instead of running the remaining iterations.
+ */
+class Cancelled : public std::runtime_error {
+
+public:
+    Cancelled() : std::runtime_error("Cancelled.") {}
+
+};
+
+/** ThreadPool runs tasks on a fixed set of worker threads.
+ *  parallel_for() also runs iterations on the calling thread, so it may be
+ *  called from inside a task without deadlocking.
+ */
+class ThreadPool {
+
+public:
+    ThreadPool(int);
+    ThreadPool();
+    ~ThreadPool();
+
+    int size();
+    void resize(int);
+    std::future<void> submit(function<void()>);
+    void parallel_for(int, function<void(int)>);
+
+private:
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    vector<thread> workers = {};
+    std::deque< function<void()> > tasks = {};
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool is_stopping = false;
+
+    void start(int);
+    void stop();
+    void enqueue(function<void()>);
+    static void work(ThreadPool *);
+
+};
+
+int hardware_threads();
+void serial_for(int, function<void(int)>);
+int band_count(int, int = BAND_ROWS);
+void parallel_for_bands(ThreadPool *, int, function<void(int, int, int)>,
+                        int = BAND_ROWS);
+
+} // namespace util_thread
+
+#endif // _UTIL_THREAD_HPP
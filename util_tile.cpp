@@ -0,0 +1,487 @@
+#include "util_tile.hpp"
+#include "util_memory.hpp"
+#include "util_term.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::vector;
+using util_memory::write_rows;
+using util_thread::serial_for;
+using util_term::log::ferr;
+
+namespace util_tile {
+
+static const char TILED_MAGIC[8] = {'I', 'M', 'G', 'T', 'I', 'L', 'E', '1'};
+static const size_t TILED_DATA_OFFSET = 4096;
+static const uint32_t TILED_MAX_TILE_SIZE = 1 << 14;
+
+/** Header of a tiled image file.
+ */
+struct TiledHeader {
+    char magic[8];
+    uint32_t rows, cols, type, tile_size;
+};
+
+/** Return whether the header of a tiled image file is valid, and the file
+ *  holds all of its tiles.
+ */
+static bool is_valid_header(const TiledHeader &header, off_t file_size)
+{
+    if (memcmp(header.magic, TILED_MAGIC, sizeof(TILED_MAGIC)) ||
+        header.type != (uint32_t)CV_MAKETYPE(CV_8U, CV_MAT_CN(header.type)) ||
+        CV_MAT_CN(header.type) > 4 || header.rows == 0 ||
+        header.rows > INT_MAX || header.cols == 0 || header.cols > INT_MAX ||
+        header.tile_size == 0 || header.tile_size > TILED_MAX_TILE_SIZE)
+        return false;
+
+    uint64_t grid_rows = (header.rows + (uint64_t)header.tile_size - 1) /
+                         header.tile_size;
+    uint64_t grid_cols = (header.cols + (uint64_t)header.tile_size - 1) /
+                         header.tile_size;
+    uint64_t tiles = grid_rows * grid_cols; // (< 2^62)
+    uint64_t tile_bytes = (uint64_t)header.tile_size * header.tile_size *
+                          CV_MAT_CN(header.type);
+    return tiles <= INT_MAX && file_size >= (off_t)TILED_DATA_OFFSET &&
+           tiles <= (file_size - TILED_DATA_OFFSET) / tile_bytes;
+}
+
+/** Open a tiled image file, for reading. (nullptr if it is not one)
+ */
+TiledImage *TiledImage::open(const string &file_name, TileCache *cache)
+{
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    TiledHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        !is_valid_header(header, lseek(fd, 0, SEEK_END))) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    TiledImage *image = new TiledImage();
+    image->file_name = file_name;
+    image->rows = header.rows;
+    image->cols = header.cols;
+    image->type = header.type;
+    image->tile_size = header.tile_size;
+    image->grid_rows = (image->rows + image->tile_size - 1) / image->tile_size;
+    image->grid_cols = (image->cols + image->tile_size - 1) / image->tile_size;
+    image->fd = fd;
+    image->cache = cache;
+    return image;
+}
+
+/** Create a tiled image file of the given size, type and tile size.
+ *  (all tiles zero; the file is sparse until written)
+ */
+TiledImage *TiledImage::create(const string &file_name, int rows, int cols,
+                               int type, int tile_size, TileCache *cache)
+{
+    int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return nullptr;
+
+    TiledHeader header;
+    memcpy(header.magic, TILED_MAGIC, sizeof(TILED_MAGIC));
+    header.rows = rows;
+    header.cols = cols;
+    header.type = type;
+    header.tile_size = tile_size;
+
+    TiledImage *image = new TiledImage();
+    image->file_name = file_name;
+    image->rows = rows;
+    image->cols = cols;
+    image->type = type;
+    image->tile_size = tile_size;
+    image->grid_rows = (rows + tile_size - 1) / tile_size;
+    image->grid_cols = (cols + tile_size - 1) / tile_size;
+    image->fd = fd;
+    image->cache = cache;
+
+    off_t size = TILED_DATA_OFFSET + image->count_tiles() * image->tile_bytes();
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        ftruncate(fd, size) != 0) {
+        delete image;
+        std::remove(file_name.c_str());
+        return nullptr;
+    }
+    return image;
+}
+
+/** Write a matrix into a new tiled image file.
+ */
+bool TiledImage::write_file(const string &file_name, const Mat &mat,
+                            int tile_size)
+{
+    TiledImage *image = create(file_name, mat.rows, mat.cols, mat.type(),
+                               tile_size, nullptr);
+    if (!image)
+        return false;
+
+    bool is_ok = true;
+    Mat buf(tile_size, tile_size, mat.type());
+    for (int i = 0; i < image->count_tiles() && is_ok; i++) {
+        Rect r = image->tile_rect(i);
+        buf.setTo(Scalar::all(0));
+        Mat part = buf(Rect(0, 0, r.width, r.height));
+        mat(r).copyTo(part);
+        is_ok = image->store(i, buf);
+    }
+    delete image;
+    return is_ok;
+}
+
+/** Return whether the file starts with the magic of a tiled image.
+ */
+bool TiledImage::is_tiled_file(const string &file_name)
+{
+    FILE *f = fopen(file_name.c_str(), "rb");
+    if (!f)
+        return false;
+    char magic[sizeof(TILED_MAGIC)];
+    bool is_tiled = fread(magic, sizeof(magic), 1, f) == 1 &&
+                    !memcmp(magic, TILED_MAGIC, sizeof(magic));
+    fclose(f);
+    return is_tiled;
+}
+
+/** Destructor of TiledImage. (writes back dirty tiles; errors are reported,
+ *  as destructors must not throw)
+ */
+TiledImage::~TiledImage()
+{
+    if (cache) {
+        try {
+            cache->drop(this);
+        } catch (std::exception &e) {
+            ferr("%s\n", e.what());
+        }
+    }
+    if (fd >= 0)
+        ::close(fd);
+    if (is_temporary)
+        std::remove(file_name.c_str());
+}
+
+/** Return the number of tiles.
+ */
+int TiledImage::count_tiles()
+{
+    return grid_rows * grid_cols;
+}
+
+/** Return the rectangle of the i-th tile (row-major) in the image.
+ */
+Rect TiledImage::tile_rect(int i)
+{
+    int x = (i % grid_cols) * tile_size;
+    int y = (i / grid_cols) * tile_size;
+    return Rect(x, y, std::min(tile_size, cols - x),
+                std::min(tile_size, rows - y));
+}
+
+/** Return the pixels of the i-th tile. (loaded through the cache; pinned
+ *  while the returned matrix is referenced)
+ */
+Mat TiledImage::read(int i)
+{
+    Rect r = tile_rect(i);
+    return cache->get(this, i, false)(Rect(0, 0, r.width, r.height));
+}
+
+/** Return the pixels of the i-th tile for overwriting. (not loaded; marked
+ *  dirty, and written back when evicted or flushed)
+ */
+Mat TiledImage::write(int i)
+{
+    Rect r = tile_rect(i);
+    return cache->get(this, i, true)(Rect(0, 0, r.width, r.height));
+}
+
+/** Write back all dirty tiles of the image.
+ */
+void TiledImage::flush()
+{
+    if (cache)
+        cache->flush(this);
+}
+
+/** Copy the tiled image into another file.
+ */
+bool TiledImage::save_as(const string &other_name)
+{
+    flush();
+    FILE *f = fopen(other_name.c_str(), "wb");
+    if (!f)
+        return false;
+
+    vector<char> buf(1 << 20);
+    off_t offset = 0;
+    ssize_t n;
+    bool is_ok = true;
+    while (is_ok && (n = pread(fd, buf.data(), buf.size(), offset)) > 0) {
+        is_ok = fwrite(buf.data(), 1, n, f) == (size_t)n;
+        offset += n;
+    }
+    is_ok = fclose(f) == 0 && is_ok;
+    return is_ok;
+}
+
+/** Return the size of a (padded) tile in bytes.
+ */
+size_t TiledImage::tile_bytes()
+{
+    return (size_t)tile_size * tile_size * CV_ELEM_SIZE(type);
+}
+
+/** Read the i-th tile from the file.
+ */
+bool TiledImage::load(int i, Mat &tile)
+{
+    tile.create(tile_size, tile_size, type);
+    size_t n = tile_bytes();
+    return pread(fd, tile.data, n, TILED_DATA_OFFSET + i * n) == (ssize_t)n;
+}
+
+/** Write the i-th tile to the file.
+ */
+bool TiledImage::store(int i, const Mat &tile)
+{
+    size_t n = tile_bytes();
+    return pwrite(fd, tile.data, n, TILED_DATA_OFFSET + i * n) == (ssize_t)n;
+}
+
+/** Constructor of TileCache. (given the most bytes of tiles kept)
+ */
+TileCache::TileCache(size_t max_bytes)
+{
+    this->max_bytes = max_bytes;
+}
+
+/** Return the full i-th tile of the image, loading it unless it is to be
+ *  overwritten. (throws if it cannot be read)
+ */
+Mat TileCache::get(TiledImage *image, int i, bool is_write)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = std::make_pair(image, i);
+    auto found = lookup.find(key);
+    if (found != lookup.end()) {
+        entries.splice(entries.begin(), entries, found->second);
+        found->second->is_dirty |= is_write;
+        return found->second->tile;
+    }
+
+    Entry entry = {image, i, Mat(), is_write};
+    if (is_write) {
+        entry.tile = Mat(image->tile_size, image->tile_size, image->type,
+                         Scalar::all(0));
+    } else {
+        if (!image->load(i, entry.tile))
+            throw std::runtime_error("Cannot read tile " + std::to_string(i) +
+                                     " of " + image->file_name);
+        loads++;
+    }
+    entries.push_front(entry);
+    lookup[key] = entries.begin();
+    bytes += image->tile_bytes();
+
+    Mat tile = entries.front().tile; // (pinned, so not evicted)
+    evict();
+    return tile;
+}
+
+/** Write back the dirty tiles of the image.
+ */
+void TileCache::flush(TiledImage *image)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Entry &entry : entries)
+        if (entry.image == image && entry.is_dirty)
+            write_back(entry);
+}
+
+/** Write back and forget all tiles of the image. (all of them are forgotten
+ *  even if one cannot be written back; the first error is thrown after)
+ */
+void TileCache::drop(TiledImage *image)
+{
+    string error;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (it->image == image) {
+            try {
+                if (it->is_dirty)
+                    write_back(*it);
+            } catch (std::runtime_error &e) {
+                if (error.empty())
+                    error = e.what();
+            }
+            bytes -= image->tile_bytes();
+            lookup.erase(std::make_pair(it->image, it->index));
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+/** Return the bytes of tiles kept.
+ */
+size_t TileCache::used_bytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
+
+/** Return the number of tiles read from disk so far.
+ */
+size_t TileCache::count_loads()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return loads;
+}
+
+/** Evict the least recently used tiles that are not pinned until the cache
+ *  fits in its budget. (with the lock held)
+ */
+void TileCache::evict()
+{
+    auto it = entries.end();
+    while (bytes > max_bytes && it != entries.begin()) {
+        --it;
+        if (it->tile.u->refcount > 1)
+            continue; // pinned
+        if (it->is_dirty)
+            write_back(*it);
+        bytes -= it->image->tile_bytes();
+        lookup.erase(std::make_pair(it->image, it->index));
+        it = entries.erase(it);
+    }
+}
+
+/** Write a dirty tile to its file. (with the lock held)
+ */
+void TileCache::write_back(Entry &entry)
+{
+    if (!entry.image->store(entry.index, entry.tile))
+        throw std::runtime_error("Cannot write tile " +
+                                 std::to_string(entry.index) + " of " +
+                                 entry.image->file_name);
+    entry.is_dirty = false;
+}
+
+/** Return the number of tile rows a rectangle of the image spans.
+ */
+static int count_tile_rows(TiledImage *image, Rect rect)
+{
+    if (rect.area() <= 0)
+        return 0;
+    return (rect.y + rect.height - 1) / image->tile_size -
+           rect.y / image->tile_size + 1;
+}
+
+/** Run fn(slot, region) on the part of every tile within the rectangle,
+ *  where slot is the tile row (from 0, top to bottom). Tile rows run in
+ *  parallel, the tiles of a row in order, so partial results kept per slot
+ *  and merged in slot order do not depend on the thread count.
+ */
+void reduce_tiles(TiledImage *image, Rect rect, ThreadPool *pool,
+                  function<void(int, const Mat &)> fn)
+{
+    rect &= Rect(0, 0, image->cols, image->rows);
+    int ty0 = rect.y / image->tile_size;
+    int tx0 = rect.x / image->tile_size;
+    int tx1 = rect.area() > 0 ?
+        (rect.x + rect.width - 1) / image->tile_size : tx0 - 1;
+
+    auto run_row = [&](int slot) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            int i = (ty0 + slot) * image->grid_cols + tx;
+            Rect r = image->tile_rect(i);
+            Rect part = r & rect;
+            Mat tile = image->read(i);
+            fn(slot, tile(Rect(part.x - r.x, part.y - r.y,
+                               part.width, part.height)));
+        }
+    };
+
+    int n = count_tile_rows(image, rect);
+    if (pool)
+        pool->parallel_for(n, run_row);
+    else
+        serial_for(n, run_row);
+}
+
+/** Run fn(src_tile, dst_tile) on every tile of the source, writing the tile
+ *  at the same place in the destination (same size and tile size), then
+ *  write back the destination.
+ */
+void transform_tiles(TiledImage *src, TiledImage *dst, ThreadPool *pool,
+                     function<void(const Mat &, Mat &)> fn)
+{
+    CV_Assert(src->rows == dst->rows && src->cols == dst->cols &&
+              src->tile_size == dst->tile_size);
+
+    auto run_tile = [&](int i) {
+        Mat src_tile = src->read(i);
+        Mat dst_tile = dst->write(i);
+        fn(src_tile, dst_tile);
+    };
+
+    if (pool)
+        pool->parallel_for(src->count_tiles(), run_tile);
+    else
+        serial_for(src->count_tiles(), run_tile);
+    dst->flush();
+}
+
+/** Export a 1- or 3-channel tiled image to a binary PGM/PPM file, one row of
+ *  tiles at a time.
+ */
+bool export_pnm(TiledImage *image, const string &file_name)
+{
+    int cn = CV_MAT_CN(image->type);
+    if (cn != 1 && cn != 3)
+        return false;
+
+    FILE *f = fopen(file_name.c_str(), "wb");
+    if (!f)
+        return false;
+    bool is_ok = fprintf(f, "P%d\n%d %d\n255\n", cn == 1 ? 5 : 6,
+                         image->cols, image->rows) > 0;
+
+    Mat strip(image->tile_size, image->cols, image->type);
+    for (int ty = 0; ty < image->grid_rows && is_ok; ty++) {
+        int strip_rows = 0;
+        for (int tx = 0; tx < image->grid_cols; tx++) {
+            int i = ty * image->grid_cols + tx;
+            Rect r = image->tile_rect(i);
+            Mat part = strip(Rect(r.x, 0, r.width, r.height));
+            image->read(i).copyTo(part);
+            strip_rows = r.height;
+        }
+        Mat rows = strip.rowRange(0, strip_rows);
+        if (cn == 3)
+            cvtColor(rows, rows, COLOR_BGR2RGB); // PPM is RGB
+        is_ok = write_rows(f, rows);
+    }
+    is_ok = fclose(f) == 0 && is_ok;
+    return is_ok;
+}
+
+} // namespace util_tile
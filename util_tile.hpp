@@ -0,0 +1,112 @@
+#ifndef _UTIL_TILE_HPP
+#define _UTIL_TILE_HPP
+
+#include "util_thread.hpp"
+
+#include <opencv2/opencv.hpp>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+using namespace cv;
+
+using std::string;
+using util_thread::ThreadPool;
+
+namespace util_tile {
+
+const int DEFAULT_TILE_SIZE = 512;
+
+class TileCache;
+
+/** TiledImage is an 8-bit image stored on disk as square tiles (.imgt), for
+ *  images larger than RAM. Tiles are read and written through a TileCache,
+ *  which bounds the memory they take.
+ *  File layout: a header (magic, rows, cols, type, tile size), then from
+ *  TILED_DATA_OFFSET every tile in row-major order, padded to full size.
+ */
+class TiledImage {
+
+public:
+    static TiledImage *open(const string &, TileCache *);
+    static TiledImage *create(const string &, int, int, int, int, TileCache *);
+    static bool write_file(const string &, const Mat &,
+                           int = DEFAULT_TILE_SIZE);
+    static bool is_tiled_file(const string &);
+    ~TiledImage();
+
+    string file_name;
+    int rows, cols, type, tile_size, grid_rows, grid_cols;
+    bool is_temporary = false; // file removed on close
+
+    int count_tiles();
+    Rect tile_rect(int);
+    Mat read(int);
+    Mat write(int);
+    void flush();
+    bool save_as(const string &);
+
+private:
+    TiledImage() {}
+    TiledImage(TiledImage const&) = delete;
+    TiledImage& operator=(TiledImage const&) = delete;
+
+    int fd = -1;
+    TileCache *cache = nullptr;
+
+    size_t tile_bytes();
+    bool load(int, Mat &);
+    bool store(int, const Mat &);
+
+    friend class TileCache;
+
+};
+
+/** TileCache keeps the most recently used tiles of all tiled images in
+ *  memory, up to a number of bytes. A tile still referenced outside the cache
+ *  is pinned; dirty tiles are written back when evicted.
+ */
+class TileCache {
+
+public:
+    TileCache(size_t);
+
+    size_t max_bytes;
+
+    Mat get(TiledImage *, int, bool);
+    void flush(TiledImage *);
+    void drop(TiledImage *);
+    size_t used_bytes();
+    size_t count_loads();
+
+private:
+    struct Entry {
+        TiledImage *image;
+        int index;
+        Mat tile; // full (padded) tile
+        bool is_dirty;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries = {}; // most recently used first
+    std::map< std::pair<TiledImage *, int>,
+              std::list<Entry>::iterator > lookup = {};
+    size_t bytes = 0;
+    size_t loads = 0;
+
+    void evict();
+    void write_back(Entry &);
+
+};
+
+void reduce_tiles(TiledImage *, Rect, ThreadPool *,
+                  function<void(int, const Mat &)>);
+void transform_tiles(TiledImage *, TiledImage *, ThreadPool *,
+                     function<void(const Mat &, Mat &)>);
+bool export_pnm(TiledImage *, const string &);
+
+} // namespace util_tile
+
+#endif // _UTIL_TILE_HPP